@@ -0,0 +1,575 @@
+/*
+ * Throughput and latency benchmarks for except.c.
+ *
+ * Each scenario runs on a number of threads simultaneously; every thread
+ * repeats the scenario's operation and times each repetition. The benchmark
+ * reports the operations per second of all threads together and the 50th,
+ * 99th and 99.9th percentile of the latencies in nanoseconds. The scenarios
+ * are:
+ *
+ * try      Enters DEPTH nested try blocks and leaves them again; the
+ *          innermost block throws an exception to its own catch block with
+ *          the probability RATIO. Reported as try-enter and try-exit, the
+ *          time per block.
+ * throw    Throws an exception through DEPTH - 1 try blocks which don't
+ *          handle it to an enclosing one which does; timed from the throw to
+ *          the landing.
+ * static   Like throw, but throws with exThrowStatic, so the message is
+ *          neither formatted nor copied. Reported as throw-static.
+ * rethrow  Throws an exception which DEPTH catch blocks catch and rethrow in
+ *          turn; timed from the throw to the landing in the outermost block.
+ * alloc    Allocates an exception with exAlloc and frees it with exFree.
+ *          Reported as exAlloc and exFree.
+ *
+ * The message of every exception consists of MSG_SIZE characters. Build and
+ * run with:
+ *
+ * gcc -O2 bench.c except.c -o bench -pthread
+ * ./bench [-s try,throw,static,rethrow,alloc] [-t 1,2,4,...] [-d DEPTH] [-r RATIO]
+ *         [-m MSG_SIZE] [-n ITERATIONS] [-f table|csv|json]
+ *
+ * -t takes a list of thread counts, so "-t 1,2,4,8,16,32,64 -s throw" shows
+ * how throwing scales. The variant column names the compile time options of
+ * the build, e.g. -DEX_LOCKED_POOL, -DEX_FAST_JMP or -DEX_BUILTIN_JMP, so
+ * results of differently built binaries can be compared in one CSV file.
+ * Latencies have the overhead of reading the clock subtracted.
+ *
+ * EX_LOCKED_POOL replaces the magazines and the lock-free stack with a
+ * mutex-guarded stack of free entries. It shows what the lock-free pool
+ * gains over a mutex alone. It is not the original pool, which scanned a
+ * fixed list of entries under the mutex and was removed along with it, and
+ * its allocations are constant time rather than a scan. No scaling results
+ * from 1 to 64 threads were recorded with this file; they need a machine
+ * with that many cores.
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mihail Ivanchev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "except.h"
+
+#define MAX_THREADS 1024
+#define MAX_ROWS 2
+
+#if defined(EX_BUILTIN_JMP)
+#define VARIANT_JMP "builtin"
+#elif defined(EX_FAST_JMP)
+#define VARIANT_JMP "_setjmp"
+#else
+#define VARIANT_JMP "setjmp"
+#endif
+
+#ifdef EX_LOCKED_POOL
+#define VARIANT VARIANT_JMP "/mutex"
+#else
+#define VARIANT VARIANT_JMP "/lock-free"
+#endif
+
+typedef enum
+{
+    FORMAT_TABLE,
+    FORMAT_CSV,
+    FORMAT_JSON
+} Format;
+
+typedef struct
+{
+    pthread_t id;
+    unsigned seed;
+    uint32_t *samples[MAX_ROWS];
+    uint64_t start;
+    uint64_t end;
+} BenchThread;
+
+typedef struct
+{
+    const char *name;
+    const char *rows[MAX_ROWS];
+    void (*run)(BenchThread *thread, long i);
+} Scenario;
+
+static int depth = 1;
+static double ratio = 0;
+static int msgSize = 16;
+static long iterations = 100000;
+static Format format = FORMAT_TABLE;
+static char *message;
+static uint64_t clockOverhead;
+static int numRows;
+static pthread_barrier_t startBarrier;
+static __thread uint64_t startTime;
+static __thread uint64_t midTime;
+static __thread uint64_t endTime;
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t elapsed(uint64_t start, uint64_t end, int count)
+{
+    uint64_t ns = end - start;
+
+    ns = ns > clockOverhead ? ns - clockOverhead : 0;
+    return (uint32_t) (ns / count);
+}
+
+/* Returns a pseudo-random number in [0, 1) using the xorshift generator. */
+static double randomUnit(BenchThread *thread)
+{
+    thread->seed ^= thread->seed << 13;
+    thread->seed ^= thread->seed >> 17;
+    thread->seed ^= thread->seed << 5;
+    return (thread->seed & 0xffffff) / (double) 0x1000000;
+}
+
+static void nestTry(int level, int doThrow)
+{
+    Exception *e;
+
+    try
+    {
+        if (level > 1)
+            nestTry(level - 1, doThrow);
+        else
+        {
+            midTime = now();
+            if (doThrow)
+                exThrow(exOther, NULL, "%s", message);
+        }
+    }
+    catch (e)
+        exFree(e);
+}
+
+static void runTry(BenchThread *thread, long i)
+{
+    int doThrow = randomUnit(thread) < ratio;
+
+    startTime = now();
+    nestTry(depth, doThrow);
+    endTime = now();
+
+    thread->samples[0][i] = elapsed(startTime, midTime, depth);
+    thread->samples[1][i] = elapsed(midTime, endTime, depth);
+}
+
+static void nestThrow(int level, int staticMsg)
+{
+    Exception *e;
+
+    if (!level)
+    {
+        startTime = now();
+        if (staticMsg)
+            exThrowStatic(exOther, NULL, message);
+        else
+            exThrow(exOther, NULL, "%s", message);
+    }
+
+    try
+        nestThrow(level - 1, staticMsg);
+    catch_codes (e, 0)
+    {
+    }
+}
+
+static void runThrow(BenchThread *thread, long i)
+{
+    Exception *e;
+
+    try
+        nestThrow(depth - 1, 0);
+    catch (e)
+    {
+        endTime = now();
+        exFree(e);
+    }
+
+    thread->samples[0][i] = elapsed(startTime, endTime, 1);
+}
+
+static void runThrowStatic(BenchThread *thread, long i)
+{
+    Exception *e;
+
+    try
+        nestThrow(depth - 1, 1);
+    catch (e)
+    {
+        endTime = now();
+        exFree(e);
+    }
+
+    thread->samples[0][i] = elapsed(startTime, endTime, 1);
+}
+
+static void nestRethrow(int level)
+{
+    Exception *e;
+
+    if (!level)
+    {
+        startTime = now();
+        exThrow(exOther, NULL, "%s", message);
+    }
+
+    try
+        nestRethrow(level - 1);
+    catch (e)
+        exRethrow(e);
+}
+
+static void runRethrow(BenchThread *thread, long i)
+{
+    Exception *e;
+
+    try
+        nestRethrow(depth - 1);
+    catch (e)
+    {
+        endTime = now();
+        exFree(e);
+    }
+
+    thread->samples[0][i] = elapsed(startTime, endTime, 1);
+}
+
+static void runAlloc(BenchThread *thread, long i)
+{
+    Exception *e;
+
+    startTime = now();
+    e = exAlloc(exOther, NULL, "%s", message);
+    midTime = now();
+    exFree(e);
+    endTime = now();
+
+    thread->samples[0][i] = elapsed(startTime, midTime, 1);
+    thread->samples[1][i] = elapsed(midTime, endTime, 1);
+}
+
+static const Scenario scenarios[] =
+{
+    { "try", { "try-enter", "try-exit" }, runTry },
+    { "throw", { "throw-catch", NULL }, runThrow },
+    { "static", { "throw-static", NULL }, runThrowStatic },
+    { "rethrow", { "rethrow-chain", NULL }, runRethrow },
+    { "alloc", { "exAlloc", "exFree" }, runAlloc }
+};
+
+static const Scenario *scenario;
+static BenchThread benchThreads[MAX_THREADS];
+
+static void* runThread(void *data)
+{
+    BenchThread *thread = (BenchThread *) data;
+    long i;
+
+    pthread_barrier_wait(&startBarrier);
+    thread->start = now();
+
+    for (i = 0; i < iterations; i++)
+        scenario->run(thread, i);
+
+    thread->end = now();
+    return NULL;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void printRow(const char *name,
+                     int numThreads,
+                     double opsPerSec,
+                     uint32_t *samples,
+                     long count)
+{
+    uint32_t p50, p99, p999;
+
+    qsort(samples, count, sizeof(uint32_t), compareSamples);
+    p50 = samples[count * 500 / 1000];
+    p99 = samples[count * 990 / 1000];
+    p999 = samples[count * 999 / 1000];
+
+    switch (format)
+    {
+    case FORMAT_TABLE:
+        printf("%-14s %-18s %7d %5d %5.2f %6d %14.0f %8u %8u %8u\n",
+               name, VARIANT, numThreads, depth, ratio, msgSize,
+               opsPerSec, p50, p99, p999);
+        break;
+    case FORMAT_CSV:
+        printf("%s,%s,%d,%d,%.2f,%d,%.0f,%u,%u,%u\n",
+               name, VARIANT, numThreads, depth, ratio, msgSize,
+               opsPerSec, p50, p99, p999);
+        break;
+    case FORMAT_JSON:
+        printf("%s  {\"scenario\": \"%s\", \"variant\": \"%s\", "
+               "\"threads\": %d, \"depth\": %d, \"ratio\": %.2f, "
+               "\"msg_size\": %d, \"ops_per_sec\": %.0f, "
+               "\"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u}",
+               numRows ? ",\n" : "",
+               name, VARIANT, numThreads, depth, ratio, msgSize,
+               opsPerSec, p50, p99, p999);
+        break;
+    }
+
+    numRows++;
+}
+
+static void runScenario(const Scenario *s, int numThreads)
+{
+    uint32_t *samples;
+    uint64_t start = UINT64_MAX, end = 0;
+    double opsPerSec;
+    int i, row;
+
+    scenario = s;
+    pthread_barrier_init(&startBarrier, NULL, numThreads + 1);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        benchThreads[i].seed = 2463534242u + i;
+        for (row = 0; row < MAX_ROWS; row++)
+            benchThreads[i].samples[row] = s->rows[row] ?
+                malloc(iterations * sizeof(uint32_t)) : NULL;
+
+        pthread_create(&benchThreads[i].id, NULL, runThread, &benchThreads[i]);
+    }
+
+    pthread_barrier_wait(&startBarrier);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_join(benchThreads[i].id, NULL);
+
+        if (benchThreads[i].start < start)
+            start = benchThreads[i].start;
+        if (benchThreads[i].end > end)
+            end = benchThreads[i].end;
+    }
+
+    opsPerSec = (double) numThreads * iterations * 1e9 / (end - start);
+    pthread_barrier_destroy(&startBarrier);
+
+    samples = malloc(numThreads * iterations * sizeof(uint32_t));
+
+    for (row = 0; row < MAX_ROWS && s->rows[row]; row++)
+    {
+        for (i = 0; i < numThreads; i++)
+        {
+            memcpy(samples + i * iterations,
+                   benchThreads[i].samples[row],
+                   iterations * sizeof(uint32_t));
+        }
+
+        printRow(s->rows[row], numThreads, opsPerSec,
+                 samples, numThreads * iterations);
+    }
+
+    free(samples);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        for (row = 0; row < MAX_ROWS; row++)
+            free(benchThreads[i].samples[row]);
+    }
+}
+
+static void calibrateClock()
+{
+    uint64_t start, ns;
+    int i;
+
+    clockOverhead = UINT64_MAX;
+
+    for (i = 0; i < 10000; i++)
+    {
+        start = now();
+        ns = now() - start;
+        if (ns < clockOverhead)
+            clockOverhead = ns;
+    }
+}
+
+/*
+ * Tests whether the comma separated list contains name as one of its items.
+ */
+static int listContains(const char *list, const char *name)
+{
+    size_t len;
+
+    for (;; list += len + 1)
+    {
+        len = strcspn(list, ",");
+        if (len == strlen(name) && !strncmp(list, name, len))
+            return 1;
+        if (!list[len])
+            return 0;
+    }
+}
+
+/*
+ * Tests whether each item of the comma separated list names a scenario.
+ */
+static int knownScenarios(const char *list)
+{
+    size_t len;
+    size_t i;
+
+    for (;; list += len + 1)
+    {
+        len = strcspn(list, ",");
+        for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        {
+            if (len == strlen(scenarios[i].name)
+                && !strncmp(list, scenarios[i].name, len))
+                break;
+        }
+        if (i == sizeof(scenarios) / sizeof(scenarios[0]))
+            return 0;
+        if (!list[len])
+            return 1;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-s try,throw,static,rethrow,alloc] [-t 1,2,4,...] "
+            "[-d DEPTH] [-r RATIO] [-m MSG_SIZE] [-n ITERATIONS] "
+            "[-f table|csv|json]\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scenarioList = "try,throw,static,rethrow,alloc";
+    char threadList[256] = "1";
+    char *numThreads;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:d:r:m:n:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            scenarioList = optarg;
+            break;
+        case 't':
+            snprintf(threadList, sizeof(threadList), "%s", optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            ratio = atof(optarg);
+            break;
+        case 'm':
+            msgSize = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "table"))
+                format = FORMAT_TABLE;
+            else if (!strcmp(optarg, "csv"))
+                format = FORMAT_CSV;
+            else if (!strcmp(optarg, "json"))
+                format = FORMAT_JSON;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (depth < 1 || msgSize < 0 || msgSize >= MAX_MSG_LEN || iterations < 1
+        || !knownScenarios(scenarioList))
+        usage(argv[0]);
+
+    message = malloc(msgSize + 1);
+    memset(message, 'x', msgSize);
+    message[msgSize] = '\0';
+
+    calibrateClock();
+    exInit();
+
+    switch (format)
+    {
+    case FORMAT_TABLE:
+        printf("%-14s %-18s %7s %5s %5s %6s %14s %8s %8s %8s\n",
+               "scenario", "variant", "threads", "depth", "ratio", "msg",
+               "ops/sec", "p50 ns", "p99 ns", "p999 ns");
+        break;
+    case FORMAT_CSV:
+        printf("scenario,variant,threads,depth,ratio,msg_size,"
+               "ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+        break;
+    case FORMAT_JSON:
+        printf("[\n");
+        break;
+    }
+
+    for (numThreads = strtok(threadList, ",");
+         numThreads;
+         numThreads = strtok(NULL, ","))
+    {
+        if (atoi(numThreads) < 1 || atoi(numThreads) > MAX_THREADS)
+            usage(argv[0]);
+
+        for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        {
+            if (listContains(scenarioList, scenarios[i].name))
+                runScenario(&scenarios[i], atoi(numThreads));
+        }
+
+        fflush(stdout);
+    }
+
+    if (format == FORMAT_JSON)
+        printf("\n]\n");
+
+    exDeinit();
+    free(message);
+
+    return 0;
+}
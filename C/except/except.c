@@ -23,359 +23,3147 @@
  */
 
 #include <assert.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef TEST
+/* A hierarchy of codes for testCodeHierarchy. */
+#define EX_USER_CODES(X)                                    \
+    X(exTestIO, exTestIO)                                   \
+    X(exTestFile, exTestIO)                                 \
+    X(exTestNotFound, exTestFile)                           \
+    X(exTestPipe, exTestIO)                                 \
+    X(exTestParse, exTestParse)
+#endif
+
 #include "except.h"
 
-#define ENV_LIST_SIZE 16
-#define EXCEPTION_LIST_SIZE 16
+#define DEFAULT_INITIAL_EXCEPTIONS 16
+#define DEFAULT_CHUNK_EXCEPTIONS 16
+#define DEFAULT_MAX_EXCEPTIONS 65536
+#define MAGAZINE_SIZE 8
+#define MAX_ARGS_SIZE 256
+#define MAX_SPEC_LEN 32
+#define ARENA_CHUNK_SIZE 4096
+#define CACHE_LINE_SIZE 64
+#define SCRATCH_BLOCK_SIZE 16384
+#define SCRATCH_ALIGN 16
+#define DEFAULT_RECORDER_THREADS 64
+#define RECORD_MSG_LEN 88
+#define RECORDER_MAGIC "EXREC1"
+#define MAX_BACKTRACE_DEPTH 16
 
-typedef struct _EnvEntry
-{
-    jmp_buf env;
-    int used;
-    int level;
-    pthread_t thread;
-    struct _EnvEntry *next;
-} EnvEntry;
+/*
+ * The exception entries are allocated in chunks of equal size, a power of 2.
+ * A chunk is never moved or freed before exDeinit, so an entry can be found
+ * by its index in constant time and its address remains valid.
+ */
+#define ENTRY(i) (&chunks[(i) >> chunkShift][(i) & chunkMask])
+
+/*
+ * The generation of an entry is incremented whenever the entry is allocated
+ * or freed, so it's odd while the entry is in use. Comparing generations
+ * detects a stale reference to an entry which has been freed and reused.
+ */
+#define IS_USED(entry) ((entry)->generation & 1)
+
+/*
+ * Static probes for perf, bpftrace and SystemTap under the provider
+ * "except", built with EX_USDT. A probe is a single nop while no tracer is
+ * attached to it. The depth is the number of try blocks the thread is in.
+ */
+#ifdef EX_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a) STAP_PROBE1(except, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(except, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(except, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void) 0)
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+/*
+ * The backtraces of the entries are kept apart from them in chunks of the
+ * same size, so that they don't bloat the entries which are touched on every
+ * allocation. Only allocated if backtraces are captured.
+ */
+#define BACKTRACE(i) (&backtraces[(i) >> chunkShift][(i) & chunkMask])
 
+/*
+ * The free exception entries are kept in a global stack. Its head packs the
+ * index of the top entry plus one (0 when the stack is empty) into the low 32
+ * bits and a tag into the high 32 bits. Every successful update increments
+ * the tag, so a compare-and-swap against a head which has been popped and
+ * pushed back in the meantime fails (the ABA problem). A thread losing such a
+ * race may still read the link of an entry which is being freed elsewhere, so
+ * the links of free entries are accessed atomically.
+ */
+#define HEAD_ENTRY(h) ((uint32_t) (h) ? ENTRY((uint32_t) (h) - 1) : NULL)
+#define HEAD_MAKE(h, e) (((((uint64_t) (h) >> 32) + 1) << 32) | \
+                         ((e) ? (e)->index + 1 : 0))
+
+/*
+ * An entry fills exactly two cache lines, the exception and the bookkeeping,
+ * so entries used by different threads never share a line. While the message
+ * is not formatted yet, args points to the format followed by the captured
+ * arguments. The chunk holds either the arguments or the message, never both.
+ * A message thrown by exThrowStatic is borrowed from the caller and has no
+ * chunk.
+ *
+ * While an entry is in use, next points to the entry of its cause and tail
+ * and length describe the chain of causes starting at the entry, so the
+ * chain is freed as a whole without rebuilding the links. An entry allocated
+ * inside a scope is linked into the scope's live entries by the indices plus
+ * one of its neighbours, 0 meaning none.
+ */
 typedef struct _ExceptionEntry
 {
     Exception exception;
+    struct _ExceptionEntry *next;
+    struct _ExceptionEntry *tail;
+    const unsigned char *args;
+    struct _ArenaChunk *chunk;
+    uint32_t index;
+    uint32_t generation;
+    uint32_t causeGeneration;
+    uint32_t length;
     struct
     {
-        int used : 1;
         int thrown : 1;
         int cause : 1;
+        int scoped : 1;
     };
-    pthread_t thread;
-    struct _ExceptionEntry *next;
-} ExceptionEntry;
+    uint32_t scopePrev;
+    uint32_t scopeNext;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ExceptionEntry;
+
+typedef struct
+{
+    int depth;
+    void *frames[MAX_BACKTRACE_DEPTH];
+} Backtrace;
+
+/*
+ * Messages and captured arguments are stored out of line in chunks which a
+ * thread fills from bottom to top. A chunk counts the allocations in it which
+ * are still in use plus one while it's the current chunk of its thread. When
+ * the count drops to one the thread starts filling the chunk from the bottom
+ * again; when it drops to zero the chunk is freed, which can happen on any
+ * thread. The data starts on its own cache line, so the owner writing messages
+ * doesn't collide with other threads releasing them.
+ */
+typedef struct _ArenaChunk
+{
+    int refs;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(CACHE_LINE_SIZE)));
+} ArenaChunk;
+
+/*
+ * The scratch memory of a thread is a list of blocks filled one after the
+ * other. A try block records the current block and how much of it is used
+ * when it's entered and restores both when it's left, which frees everything
+ * allocated in between. The blocks are kept for reuse until the thread exits.
+ */
+typedef struct _ScratchBlock
+{
+    struct _ScratchBlock *next;
+    size_t size;
+    char data[] __attribute__((aligned(SCRATCH_ALIGN)));
+} ScratchBlock;
+
+/* The length modifiers of a conversion specification. */
+enum
+{
+    LEN_NONE = 0,
+    LEN_HH = 'H',
+    LEN_H = 'h',
+    LEN_L = 'l',
+    LEN_LL = 'q',
+    LEN_J = 'j',
+    LEN_Z = 'z',
+    LEN_T = 't',
+    LEN_BIG_L = 'L'
+};
+
+/* The precision of a conversion specification without one or with a '*'. */
+#define NO_PRECISION -1
+#define STAR_PRECISION -2
+
+typedef struct
+{
+    int length;
+    int numStars;
+    int precision;
+    int size;
+    char conversion;
+} FormatSpec;
+
+typedef struct
+{
+    void (*fn)(void *);
+    void *arg;
+} Cleanup;
+
+/*
+ * The try blocks, cleanup handlers and scratch memory of a fiber. While the
+ * context runs on a thread, its state lives in the thread's variables; the
+ * context only keeps a copy while it's switched out. The frame depth is the
+ * number of try blocks the fiber is in, which can't be told from the
+ * counters of a thread when fibers move between threads.
+ */
+struct _ExContext
+{
+    ExFrame *lastFrame;
+    ScratchBlock *scratchBlocks;
+    ScratchBlock *scratch;
+    size_t scratchUsed;
+    Cleanup *cleanups;
+    int numCleanups;
+    unsigned frameDepth;
+    Cleanup storage[MAX_CLEANUPS];
+};
+
+/*
+ * The flight recorder keeps the latest throws of every thread in a ring of
+ * its own, so recording never waits for another thread. The rings are slots
+ * in a single mapping, of a file if one is configured, which then keeps the
+ * records when the process crashes. The sequence number of a record is odd
+ * while the record is written, so a dump on another thread can detect a torn
+ * read and retry. All fields, the message included, are words accessed
+ * atomically for the same reason.
+ */
+typedef struct
+{
+    uint32_t seq;
+    int32_t code;
+    uint32_t rethrown;
+    uint32_t reserved;
+    uint64_t timeNs;
+    uint64_t thread;
+    uint64_t site;
+    uint64_t msg[RECORD_MSG_LEN / 8];
+} Record;
+
+typedef struct
+{
+    uint32_t claimed;
+    uint32_t reserved;
+    uint64_t count;
+    char padding[CACHE_LINE_SIZE - 16];
+    Record records[];
+} RecorderRing;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t numRings;
+    uint32_t ringSize;
+    char padding[CACHE_LINE_SIZE - 16];
+} RecorderHeader;
+
+#define RING(header, i)                                                     \
+    ((RecorderRing *) ((char *) (header) + sizeof(RecorderHeader) +         \
+                       (size_t) (i) * (sizeof(RecorderRing) +               \
+                                       (header)->ringSize * sizeof(Record))))
+
+/*
+ * Entries freed by a thread are cached in its magazine and handed out again
+ * without touching the global stack.
+ */
+typedef struct
+{
+    ExceptionEntry *head;
+    int count;
+} Magazine;
+
+/*
+ * The counters of a throw site as read once by exSiteReport, so that sorting
+ * doesn't see them change.
+ */
+typedef struct
+{
+    const ExSite *site;
+    unsigned long long hits;
+    unsigned long long rethrows;
+    unsigned long long cycles;
+} SiteCounters;
+
+/*
+ * The state of a thread when exScopeBegin was called and the list of the
+ * entries allocated since which are still in use, by index plus one. exFree
+ * unlinks an entry, so the list holds exactly what exScopeEnd reclaims.
+ */
+typedef struct
+{
+    int active;
+    ExFrame *lastFrame;
+    unsigned long long liveFrames;
+    unsigned frameDepth;
+    int numCleanups;
+    ScratchBlock *scratch;
+    size_t scratchUsed;
+    uint32_t head;
+} Scope;
+
+/*
+ * The state of a thread which is released when the thread exits. The context
+ * running on the thread is NULL for the thread's own, whose state is kept in
+ * ownContext while another one runs. The states
+ * of all threads are linked, so that exGetStats can sum up their counters.
+ * Only the owning thread writes its counters, other threads may read them.
+ */
+typedef struct _ThreadState
+{
+    Magazine magazine;
+    ArenaChunk *arena;
+    ScratchBlock *scratchBlocks;
+    ScratchBlock *scratch;
+    size_t scratchUsed;
+    Cleanup *cleanups;
+    int numCleanups;
+    unsigned frameDepth;
+    ExContext *context;
+    ExContext ownContext;
+    RecorderRing *ring;
+    int noRing;
+    ExSite *site;
+    unsigned long long siteStart;
+    unsigned throwsSinceBacktrace;
+    Scope scope;
+    ExStats stats;
+    long long liveExceptions;
+    int registered;
+    struct _ThreadState *prev;
+    struct _ThreadState *next;
+} ThreadState;
+
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&threadState.stats.field, \
+                     threadState.stats.field + (n), __ATOMIC_RELAXED)
+#define STAT_MAX(field, value) \
+    ((value) > threadState.stats.field ? \
+     __atomic_store_n(&threadState.stats.field, (value), __ATOMIC_RELAXED) : \
+     (void) 0)
+
+ExceptionCode exCodeEnds[exNumCodes];
+
+#define CODE_NAME(code, parent) #code,
+#define CODE_PARENT(code, parent) parent,
+
+static const char *codeNames[] = { EX_CODES(CODE_NAME) };
+static const ExceptionCode codeParents[] = { EX_CODES(CODE_PARENT) };
+
+static ExceptionEntry **chunks;
+static Backtrace **backtraces;
+static unsigned backtraceSampling;
+static uint32_t numChunks;
+static uint32_t maxChunks;
+static uint32_t chunkShift;
+static uint32_t chunkMask;
+
+/*
+ * The head of the global stack is written by every thread whose magazine runs
+ * empty or full, so it has a cache line of its own instead of invalidating the
+ * pool geometry which every thread reads.
+ */
+static union
+{
+    uint64_t head;
+    char padding[CACHE_LINE_SIZE];
+} freeList __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static pthread_key_t threadKey;
+static __thread ThreadState threadState;
+static __thread ExFrame *lastFrame;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadState *threadStates;
+static ExStats retiredStats;
+static int lazyMessages;
+static RecorderHeader *recorder;
+static size_t recorderSize;
+static ExSite *sites;
+
+/*
+ * Reads the time stamp counter where there is one, otherwise the monotonic
+ * clock in nanoseconds.
+ */
+unsigned long long readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void lockMutex()
+{
+    struct timespec start, end;
+
+    STAT_ADD(mutexAcquisitions, 1);
+
+    if (pthread_mutex_trylock(&mutex))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&mutex);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        STAT_ADD(mutexWaitNs,
+                 (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                 end.tv_nsec - start.tv_nsec);
+    }
+}
+
+ExceptionEntry* getExceptionEntry(Exception *e)
+{
+    ExceptionEntry *entry = (ExceptionEntry *)
+                            ((char *) e - offsetof(ExceptionEntry, exception));
+
+    assert(entry->index <
+           __atomic_load_n(&numChunks, __ATOMIC_ACQUIRE) << chunkShift);
+    assert(ENTRY(entry->index) == entry);
+
+    return entry;
+}
+
+#ifndef EX_LOCKED_POOL
+
+ExceptionEntry* popFreeEntry()
+{
+    uint64_t head = __atomic_load_n(&freeList.head, __ATOMIC_ACQUIRE);
+    ExceptionEntry *entry, *next;
+
+    do
+    {
+        entry = HEAD_ENTRY(head);
+        if (!entry)
+            return NULL;
+
+        next = __atomic_load_n(&entry->next, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&freeList.head, &head,
+                                        HEAD_MAKE(head, next), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return entry;
+}
+
+void pushFreeEntries(ExceptionEntry *first, ExceptionEntry *last)
+{
+    uint64_t head = __atomic_load_n(&freeList.head, __ATOMIC_RELAXED);
+
+    do
+        __atomic_store_n(&last->next, HEAD_ENTRY(head), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&freeList.head, &head,
+                                        HEAD_MAKE(head, first), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#else
+
+/*
+ * The global stack guarded by a mutex, kept for comparison benchmarks. The
+ * mutex is released before the pool grows, which locks it on its own.
+ */
+
+ExceptionEntry* popFreeEntry()
+{
+    ExceptionEntry *entry;
+
+    lockMutex();
+
+    entry = HEAD_ENTRY(freeList.head);
+    if (entry)
+        freeList.head = HEAD_MAKE(freeList.head, entry->next);
+
+    pthread_mutex_unlock(&mutex);
+    return entry;
+}
+
+void pushFreeEntries(ExceptionEntry *first, ExceptionEntry *last)
+{
+    lockMutex();
+
+    last->next = HEAD_ENTRY(freeList.head);
+    freeList.head = HEAD_MAKE(freeList.head, first);
+
+    pthread_mutex_unlock(&mutex);
+}
+
+#endif
+
+/*
+ * Adds a chunk to the pool. Returns its first entry and pushes the rest on the
+ * global stack, or returns NULL when the pool has reached its maximal size or
+ * memory is exhausted.
+ */
+ExceptionEntry* addExceptionChunk()
+{
+    ExceptionEntry *chunk = NULL;
+    uint32_t i;
+
+    lockMutex();
+
+    if (numChunks < maxChunks &&
+        posix_memalign((void **) &chunk, CACHE_LINE_SIZE,
+                       (chunkMask + 1) * sizeof(ExceptionEntry)))
+        chunk = NULL;
+
+    if (chunk && backtraces &&
+        !(backtraces[numChunks] = calloc(chunkMask + 1, sizeof(Backtrace))))
+    {
+        free(chunk);
+        chunk = NULL;
+    }
+
+    if (chunk)
+    {
+        memset(chunk, 0, (chunkMask + 1) * sizeof(ExceptionEntry));
+
+        for (i = 0; i <= chunkMask; i++)
+        {
+            chunk[i].index = (numChunks << chunkShift) + i;
+            chunk[i].next = i < chunkMask ? &chunk[i + 1] : NULL;
+        }
+
+        chunks[numChunks] = chunk;
+        __atomic_store_n(&numChunks, numChunks + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (chunk && chunkMask)
+        pushFreeEntries(&chunk[1], &chunk[chunkMask]);
+
+    return chunk;
+}
+
+void releaseArenaChunk(ArenaChunk *chunk)
+{
+    if (chunk && !__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL))
+        free(chunk);
+}
+
+/*
+ * Adds the counters in src to dst. The maximal frame depth is the maximum of
+ * both instead.
+ */
+void addStats(ExStats *dst, ExStats *src)
+{
+#define ADD(field) (dst->field += __atomic_load_n(&src->field, __ATOMIC_RELAXED))
+
+    ADD(tryFrames);
+    ADD(throws);
+    ADD(rethrows);
+    ADD(allocs);
+    ADD(frees);
+    ADD(maxLiveExceptions);
+    ADD(liveFrames);
+    ADD(mutexAcquisitions);
+    ADD(mutexWaitNs);
+
+#undef ADD
+
+    if (__atomic_load_n(&src->maxFrameDepth, __ATOMIC_RELAXED) > dst->maxFrameDepth)
+        dst->maxFrameDepth = __atomic_load_n(&src->maxFrameDepth, __ATOMIC_RELAXED);
+}
+
+void freeScratchBlocks(ScratchBlock *block)
+{
+    ScratchBlock *next;
+
+    for (; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+}
+
+/*
+ * Releases the state of the calling thread; data is its ThreadState.
+ */
+void releaseThread(void *data)
+{
+    ThreadState *state = (ThreadState *) data;
+    ExceptionEntry *last, *entry;
+
+    if (state->context)
+        exContextSwitch(NULL);
+
+    if (state->magazine.head)
+    {
+        for (last = state->magazine.head; last->next; last = last->next)
+            ;
+
+        pushFreeEntries(state->magazine.head, last);
+    }
+
+    releaseArenaChunk(state->arena);
+
+    freeScratchBlocks(state->scratchBlocks);
+
+    state->magazine.head = NULL;
+    state->magazine.count = 0;
+    state->arena = NULL;
+    state->scratchBlocks = NULL;
+    state->scratch = NULL;
+    state->scratchUsed = 0;
+
+    /* Entries left in a scope the thread never ended become ordinary. */
+    for (; state->scope.head; state->scope.head = entry->scopeNext)
+    {
+        entry = ENTRY(state->scope.head - 1);
+        entry->scoped = 0;
+    }
+
+    memset(&state->scope, 0, sizeof(Scope));
+
+    if (state->ring)
+        __atomic_store_n(&state->ring->claimed, 0, __ATOMIC_RELEASE);
+
+    state->ring = NULL;
+    state->noRing = 0;
+
+    if (state->registered)
+    {
+        lockMutex();
+
+        addStats(&retiredStats, &state->stats);
+
+        if (state->prev)
+            state->prev->next = state->next;
+        else
+            threadStates = state->next;
+
+        if (state->next)
+            state->next->prev = state->prev;
+
+        pthread_mutex_unlock(&mutex);
+
+        memset(&state->stats, 0, sizeof(ExStats));
+        state->liveExceptions = 0;
+        state->registered = 0;
+    }
+}
+
+void registerThread()
+{
+    if (!threadState.registered)
+    {
+        pthread_setspecific(threadKey, &threadState);
+        threadState.registered = 1;
+
+        lockMutex();
+
+        threadState.prev = NULL;
+        threadState.next = threadStates;
+        if (threadStates)
+            threadStates->prev = &threadState;
+        threadStates = &threadState;
+
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+/*
+ * Copies size bytes of data into the arena of the calling thread. Returns the
+ * copy and stores the chunk holding it in chunkOut.
+ */
+void* arenaStore(const void *data, size_t size, ArenaChunk **chunkOut)
+{
+    ArenaChunk *chunk = threadState.arena;
+    void *copy;
+
+    if (chunk && __atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) == 1)
+        chunk->used = 0;
+
+    if (!chunk || chunk->used + size > chunk->size)
+    {
+        releaseArenaChunk(chunk);
+
+        if (posix_memalign((void **) &chunk, CACHE_LINE_SIZE,
+                           sizeof(ArenaChunk) +
+                           (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE)))
+        {
+            fprintf(stderr, "Out of memory for exception messages.\n");
+            abort();
+        }
+
+        chunk->refs = 1;
+        chunk->size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk->used = 0;
+
+        threadState.arena = chunk;
+        registerThread();
+    }
+
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+
+    copy = chunk->data + chunk->used;
+    memcpy(copy, data, size);
+    chunk->used += size;
+
+    *chunkOut = chunk;
+    return copy;
+}
+
+/*
+ * Links an entry allocated inside the scope of the thread into its list.
+ */
+void linkScopeEntry(ExceptionEntry *entry)
+{
+    Scope *scope = &threadState.scope;
+
+    entry->scoped = 1;
+    entry->scopePrev = 0;
+    entry->scopeNext = scope->head;
+
+    if (scope->head)
+        ENTRY(scope->head - 1)->scopePrev = entry->index + 1;
+
+    scope->head = entry->index + 1;
+}
+
+/*
+ * Unlinks an entry from the list of the thread's scope.
+ */
+void unlinkScopeEntry(ExceptionEntry *entry)
+{
+    Scope *scope = &threadState.scope;
+
+    if (entry->scopePrev)
+        ENTRY(entry->scopePrev - 1)->scopeNext = entry->scopeNext;
+    else
+        scope->head = entry->scopeNext;
+
+    if (entry->scopeNext)
+        ENTRY(entry->scopeNext - 1)->scopePrev = entry->scopePrev;
+
+    entry->scoped = 0;
+}
+
+ExceptionEntry* allocExceptionEntry()
+{
+    Magazine *magazine = &threadState.magazine;
+    ExceptionEntry *entry = magazine->head;
+
+    if (entry)
+    {
+        magazine->head = entry->next;
+        magazine->count--;
+    }
+    else if (!(entry = popFreeEntry()) && !(entry = addExceptionChunk()))
+    {
+        fprintf(stderr, "The exception pool is exhausted.\n");
+        abort();
+    }
+
+    STAT_ADD(allocs, 1);
+    if (++threadState.liveExceptions > 0)
+        STAT_MAX(maxLiveExceptions,
+                 (unsigned long long) threadState.liveExceptions);
+
+    entry->cause = 0;
+    entry->thrown = 0;
+    entry->args = NULL;
+    entry->chunk = NULL;
+    entry->scoped = 0;
+    entry->generation++;
+
+    if (backtraces)
+        BACKTRACE(entry->index)->depth = 0;
+
+    if (threadState.scope.active)
+        linkScopeEntry(entry);
+
+    return entry;
+}
+
+/*
+ * Makes cause the cause of the exception in entry and links the entry in
+ * front of the chain of cause.
+ */
+void setCause(ExceptionEntry *entry, Exception *cause)
+{
+    ExceptionEntry *causeEntry = NULL;
+
+    *((Exception **) &entry->exception.cause) = cause;
+
+    entry->tail = entry;
+    entry->length = 1;
+
+    if (cause)
+    {
+        causeEntry = getExceptionEntry(cause);
+
+        assert(IS_USED(causeEntry));
+        assert(!causeEntry->cause);
+        assert(!causeEntry->thrown);
+
+        causeEntry->cause = 1;
+        entry->causeGeneration = causeEntry->generation;
+        entry->tail = causeEntry->tail;
+        entry->length = causeEntry->length + 1;
+    }
+
+    /* Stale pops of the free list may still read the link. */
+    __atomic_store_n(&entry->next, causeEntry, __ATOMIC_RELAXED);
+}
+
+void freeExceptionEntries(ExceptionEntry *first,
+                          ExceptionEntry *last,
+                          int count)
+{
+#ifndef EX_LOCKED_POOL
+    Magazine *magazine = &threadState.magazine;
+
+    if (magazine->count + count <= MAGAZINE_SIZE)
+    {
+        registerThread();
+
+        __atomic_store_n(&last->next, magazine->head, __ATOMIC_RELAXED);
+        magazine->head = first;
+        magazine->count += count;
+        return;
+    }
+#else
+    (void) count;
+#endif
+
+    pushFreeEntries(first, last);
+}
+
+/*
+ * Parses the conversion specification at fmt, which points to a '%'.
+ */
+void parseSpec(const char *fmt, FormatSpec *spec)
+{
+    const char *p = fmt + 1;
+
+    spec->numStars = 0;
+    spec->precision = NO_PRECISION;
+    p += strspn(p, "-+ #0");
+
+    if (*p == '*')
+    {
+        spec->numStars++;
+        p++;
+    }
+    else
+        p += strspn(p, "0123456789");
+
+    if (*p == '.')
+    {
+        if (*++p == '*')
+        {
+            spec->numStars++;
+            spec->precision = STAR_PRECISION;
+            p++;
+        }
+        else
+        {
+            /* Large precisions are capped, they only limit a scan. */
+            for (spec->precision = 0; *p >= '0' && *p <= '9'; p++)
+            {
+                if (spec->precision < MAX_MSG_LEN)
+                    spec->precision = spec->precision * 10 + (*p - '0');
+            }
+        }
+    }
+
+    if (p[0] == 'h' && p[1] == 'h')
+        spec->length = LEN_HH, p += 2;
+    else if (p[0] == 'l' && p[1] == 'l')
+        spec->length = LEN_LL, p += 2;
+    else if (*p && strchr("hljztL", *p))
+        spec->length = *p++;
+    else
+        spec->length = LEN_NONE;
+
+    spec->conversion = *p ? *p++ : '\0';
+    spec->size = p - fmt;
+}
+
+uintmax_t fetchInteger(va_list *argList, int length, int isSigned)
+{
+    switch (length)
+    {
+    case LEN_L:
+        return isSigned ? (uintmax_t) va_arg(*argList, long)
+                        : va_arg(*argList, unsigned long);
+    case LEN_LL:
+        return isSigned ? (uintmax_t) va_arg(*argList, long long)
+                        : va_arg(*argList, unsigned long long);
+    case LEN_J:
+        return va_arg(*argList, uintmax_t);
+    case LEN_Z:
+        return va_arg(*argList, size_t);
+    case LEN_T:
+        return va_arg(*argList, ptrdiff_t);
+    default:
+        return isSigned ? (uintmax_t) va_arg(*argList, int)
+                        : va_arg(*argList, unsigned);
+    }
+}
+
+/*
+ * Copies the arguments of a message into args, so that the message can be
+ * formatted later. Returns the number of bytes used or -1 if the arguments
+ * don't fit or the format contains a conversion which can't be deferred; the
+ * message has to be formatted right away then.
+ */
+int captureArgs(unsigned char args[MAX_ARGS_SIZE],
+                const char *fmt,
+                va_list argList)
+{
+    size_t size = 0, len, limit;
+    FormatSpec spec;
+    va_list copy;
+    const char *p, *s;
+    uintmax_t i;
+    long double ld;
+    double d;
+    void *ptr;
+    int star = 0, n;
+
+#define PUT_ARG(v) (size + sizeof(v) <= MAX_ARGS_SIZE ? \
+                    (memcpy(args + size, &(v), sizeof(v)), size += sizeof(v)) : \
+                    (size = MAX_ARGS_SIZE + 1))
+
+    va_copy(copy, argList);
+
+    for (p = strchr(fmt, '%'); p; p = strchr(p + spec.size, '%'))
+    {
+        parseSpec(p, &spec);
+
+        if (spec.size >= MAX_SPEC_LEN)
+            break;
+
+        for (n = 0; n < spec.numStars; n++)
+        {
+            star = va_arg(copy, int);
+            PUT_ARG(star);
+        }
+
+        /* The star of the precision comes last; a negative one means none. */
+        if (spec.precision == STAR_PRECISION)
+            spec.precision = star >= 0 ? star : NO_PRECISION;
+
+        switch (spec.conversion)
+        {
+        case '%':
+            break;
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            i = fetchInteger(&copy, spec.length, strchr("di", spec.conversion) != NULL);
+            PUT_ARG(i);
+            break;
+        case 'c':
+            if (spec.length != LEN_NONE)
+                goto unsupported;
+
+            n = va_arg(copy, int);
+            PUT_ARG(n);
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (spec.length == LEN_BIG_L)
+            {
+                ld = va_arg(copy, long double);
+                PUT_ARG(ld);
+            }
+            else
+            {
+                d = va_arg(copy, double);
+                PUT_ARG(d);
+            }
+            break;
+        case 's':
+            if (spec.length != LEN_NONE)
+                goto unsupported;
+
+            /* Left to vsnprintf, which prints it its own way. */
+            if (!(s = va_arg(copy, const char *)) || size > MAX_ARGS_SIZE)
+                goto unsupported;
+
+            /* Only the characters which are printed are copied, the string
+             * needn't be terminated within the precision. The scan stops
+             * where the string wouldn't fit anyway. */
+            limit = MAX_ARGS_SIZE - size;
+            if (spec.precision >= 0 && (size_t) spec.precision < limit)
+                len = strnlen(s, spec.precision);
+            else if ((len = strnlen(s, limit)) == limit)
+                goto unsupported;
+
+            memcpy(args + size, s, len);
+            args[size + len] = '\0';
+            size += len + 1;
+            break;
+        case 'p':
+            ptr = va_arg(copy, void *);
+            PUT_ARG(ptr);
+            break;
+        default:
+            goto unsupported;
+        }
+
+        if (size > MAX_ARGS_SIZE)
+            goto unsupported;
+    }
+
+#undef PUT_ARG
+
+    va_end(copy);
+    return p ? -1 : (int) size;
+
+unsupported:
+    va_end(copy);
+    return -1;
+}
+
+/*
+ * Formats a message whose arguments were captured by captureArgs into out,
+ * which holds MAX_MSG_LEN characters. Returns the length of the message.
+ */
+size_t renderMessage(char *out,
+                     const char *fmt,
+                     const unsigned char *args)
+{
+    const char *next;
+    char buf[MAX_SPEC_LEN + 2 * 12];
+    size_t len = 0, n;
+    FormatSpec spec;
+    uintmax_t i;
+    long double ld;
+    double d;
+    void *ptr;
+    int star, c, k;
+    char *b;
+
+#define GET_ARG(v) (memcpy(&(v), args, sizeof(v)), args += sizeof(v))
+#define APPEND(...) (n = snprintf(out + len, MAX_MSG_LEN - len, __VA_ARGS__), \
+                     len = len + n < MAX_MSG_LEN ? len + n : MAX_MSG_LEN - 1)
+
+    for (; (next = strchr(fmt, '%')); fmt = next + spec.size)
+    {
+        APPEND("%.*s", (int) (next - fmt), fmt);
+        parseSpec(next, &spec);
+
+        /* Substitute the stars with the captured width and precision. */
+
+        for (b = buf, k = 0; k < spec.size; k++)
+        {
+            if (next[k] != '*')
+                *b++ = next[k];
+            else
+            {
+                GET_ARG(star);
+                if (star >= 0)
+                    b += sprintf(b, "%d", star);
+                else if (next[k - 1] != '.')
+                    b += sprintf(b, "-%d", -star);
+                else
+                    b--;
+            }
+        }
+
+        *b = '\0';
+
+        switch (spec.conversion)
+        {
+        case '%':
+            APPEND("%%");
+            break;
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            GET_ARG(i);
+
+            switch (spec.length)
+            {
+            case LEN_L:
+                APPEND(buf, (unsigned long) i);
+                break;
+            case LEN_LL:
+                APPEND(buf, (unsigned long long) i);
+                break;
+            case LEN_J:
+                APPEND(buf, i);
+                break;
+            case LEN_Z:
+                APPEND(buf, (size_t) i);
+                break;
+            case LEN_T:
+                APPEND(buf, (ptrdiff_t) i);
+                break;
+            default:
+                APPEND(buf, (unsigned) i);
+            }
+            break;
+        case 'c':
+            GET_ARG(c);
+            APPEND(buf, c);
+            break;
+        case 's':
+            APPEND(buf, (const char *) args);
+            args += strlen((const char *) args) + 1;
+            break;
+        case 'p':
+            GET_ARG(ptr);
+            APPEND(buf, ptr);
+            break;
+        default:
+            if (spec.length == LEN_BIG_L)
+            {
+                GET_ARG(ld);
+                APPEND(buf, ld);
+            }
+            else
+            {
+                GET_ARG(d);
+                APPEND(buf, d);
+            }
+        }
+    }
+
+    APPEND("%s", fmt);
+
+#undef APPEND
+#undef GET_ARG
+
+    return len;
+}
+
+/*
+ * Sets the message of the exception in entry, either formatting it right away
+ * or capturing the arguments if messages are formatted lazily. The format is
+ * copied behind the arguments, since the caller's may not outlive the
+ * exception.
+ */
+void setMessage(ExceptionEntry *entry, const char *msg, va_list argList)
+{
+    unsigned char args[sizeof(const char *) + MAX_ARGS_SIZE + MAX_MSG_LEN];
+    char buf[MAX_MSG_LEN];
+    const char *format;
+    size_t formatLen;
+    int size;
+
+    if (lazyMessages &&
+        (formatLen = strlen(msg) + 1) <= MAX_MSG_LEN &&
+        (size = captureArgs(args + sizeof(const char *), msg, argList)) >= 0)
+    {
+        memcpy(args + sizeof(const char *) + size, msg, formatLen);
+        entry->args = arenaStore(args,
+                                 sizeof(const char *) + size + formatLen,
+                                 &entry->chunk);
+        format = (const char *) entry->args + sizeof(const char *) + size;
+        memcpy((unsigned char *) entry->args, &format, sizeof(const char *));
+        entry->exception.msg = NULL;
+        return;
+    }
+
+    size = vsnprintf(buf, MAX_MSG_LEN, msg, argList);
+    if (size < 0)
+        size = 0;
+    else if (size >= MAX_MSG_LEN)
+        size = MAX_MSG_LEN - 1;
+
+    buf[size] = '\0';
+    entry->exception.msg = arenaStore(buf, size + 1, &entry->chunk);
+}
+
+/*
+ * Numbers the last descendant of every code, so that the descendants of a
+ * code are the range from the code to that number. Aborts if the codes are
+ * listed in the wrong order.
+ */
+void buildCodeHierarchy()
+{
+    ExceptionCode path[exNumCodes];
+    int depth = 0, i;
+
+    for (i = 0; i < exNumCodes; i++)
+    {
+        /* The parent has to be on the path to the previous code. */
+        while (depth && path[depth - 1] != codeParents[i])
+            depth--;
+
+        if (!depth && codeParents[i] != (ExceptionCode) i)
+        {
+            fprintf(stderr, "The exception code %s isn't listed after its parent.\n",
+                    codeNames[i]);
+            abort();
+        }
+
+        path[depth++] = (ExceptionCode) i;
+        exCodeEnds[i] = (ExceptionCode) i;
+    }
+
+    for (i = exNumCodes - 1; i >= 0; i--)
+    {
+        if (exCodeEnds[i] > exCodeEnds[codeParents[i]])
+            exCodeEnds[codeParents[i]] = exCodeEnds[i];
+    }
+}
+
+/*
+ * Maps the flight recorder, to the configured file if possible.
+ */
+void mapRecorder(const ExConfig *config)
+{
+    uint32_t numRings = config->recorderThreads ? config->recorderThreads
+                                                : DEFAULT_RECORDER_THREADS;
+    size_t size = sizeof(RecorderHeader) +
+                  numRings * (sizeof(RecorderRing) +
+                              config->recorderSize * sizeof(Record));
+    void *map = MAP_FAILED;
+    int fd;
+
+    if (config->recorderFile)
+    {
+        fd = open(config->recorderFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            if (!ftruncate(fd, size))
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+
+        if (map == MAP_FAILED)
+        {
+            fprintf(stderr, "Can't map the flight recorder to %s, keeping it in memory.\n",
+                    config->recorderFile);
+        }
+    }
+
+    if (map == MAP_FAILED)
+    {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+        {
+            fprintf(stderr, "Out of memory for the flight recorder.\n");
+            abort();
+        }
+    }
+
+    recorder = (RecorderHeader *) map;
+    recorderSize = size;
+    recorder->numRings = numRings;
+    recorder->ringSize = config->recorderSize;
+
+    /* Last, so that a file which is cut short isn't taken for a valid one. */
+    memcpy(recorder->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+}
+
+RecorderRing* claimRing()
+{
+    RecorderRing *ring;
+    uint32_t i, unclaimed;
+
+    if (threadState.noRing)
+        return NULL;
+
+    for (i = 0; i < recorder->numRings; i++)
+    {
+        ring = RING(recorder, i);
+        unclaimed = 0;
+
+        if (__atomic_compare_exchange_n(&ring->claimed, &unclaimed, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            threadState.ring = ring;
+            registerThread();
+            return ring;
+        }
+    }
+
+    /* The thread isn't recorded. */
+    threadState.noRing = 1;
+    return NULL;
+}
+
+/*
+ * Records a throw of the exception in entry in the ring of the calling
+ * thread. A lazily formatted message which hasn't been read yet is recorded
+ * as its format.
+ */
+void recordThrow(ExceptionEntry *entry, int rethrown, const void *site)
+{
+    RecorderRing *ring = threadState.ring;
+    Record *record;
+    struct timespec now;
+    uint64_t msg[RECORD_MSG_LEN / 8] = { 0 };
+    const char *text = entry->exception.msg;
+    uint32_t seq, i;
+
+    if (!ring && !(ring = claimRing()))
+        return;
+
+    if (!text && entry->args)
+        memcpy(&text, entry->args, sizeof(const char *));
+    if (text)
+        strncpy((char *) msg, text, RECORD_MSG_LEN - 1);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    record = &ring->records[ring->count % recorder->ringSize];
+    seq = record->seq;
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&record->code, entry->exception.code, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->rethrown, rethrown, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->timeNs,
+                     now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->thread, (uint64_t) (uintptr_t) pthread_self(),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&record->site, (uint64_t) (uintptr_t) site,
+                     __ATOMIC_RELAXED);
+    for (i = 0; i < RECORD_MSG_LEN / 8; i++)
+        __atomic_store_n(&record->msg[i], msg[i], __ATOMIC_RELAXED);
+
+    __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies a record unless it's being written. Returns 0 if no consistent copy
+ * could be made.
+ */
+int readRecord(const Record *record, Record *copy)
+{
+    uint32_t seq, i;
+    int tries;
+
+    for (tries = 0; tries < 8; tries++)
+    {
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        copy->code = __atomic_load_n(&record->code, __ATOMIC_RELAXED);
+        copy->rethrown = __atomic_load_n(&record->rethrown, __ATOMIC_RELAXED);
+        copy->timeNs = __atomic_load_n(&record->timeNs, __ATOMIC_RELAXED);
+        copy->thread = __atomic_load_n(&record->thread, __ATOMIC_RELAXED);
+        copy->site = __atomic_load_n(&record->site, __ATOMIC_RELAXED);
+        for (i = 0; i < RECORD_MSG_LEN / 8; i++)
+            copy->msg[i] = __atomic_load_n(&record->msg[i], __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq)
+        {
+            ((char *) copy->msg)[RECORD_MSG_LEN - 1] = '\0';
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Prints the records of every ring, oldest first.
+ */
+void dumpRecorder(const RecorderHeader *header, FILE *out)
+{
+    const RecorderRing *ring;
+    Record copy;
+    uint64_t count, n;
+    uint32_t i;
+
+    for (i = 0; i < header->numRings; i++)
+    {
+        ring = RING(header, i);
+        count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+
+        n = count > header->ringSize ? count - header->ringSize : 0;
+        for (; n < count; n++)
+        {
+            if (!readRecord(&ring->records[n % header->ringSize], &copy))
+                continue;
+
+            fprintf(out, "%llu.%09llu thread %llx %s code %d at %p: %s\n",
+                    (unsigned long long) (copy.timeNs / 1000000000),
+                    (unsigned long long) (copy.timeNs % 1000000000),
+                    (unsigned long long) copy.thread,
+                    copy.rethrown ? "rethrew" : "threw",
+                    copy.code,
+                    (void *) (uintptr_t) copy.site,
+                    (char *) copy.msg);
+        }
+    }
+}
+
+void pushCallingEnv(ExFrame *frame)
+{
+    frame->exception = NULL;
+    frame->prev = lastFrame;
+    frame->scratch = threadState.scratch;
+    frame->scratchUsed = threadState.scratchUsed;
+    frame->cleanups = threadState.numCleanups;
+    lastFrame = frame;
+
+    if (!threadState.registered)
+        registerThread();
+
+    threadState.frameDepth++;
+
+    STAT_ADD(tryFrames, 1);
+    STAT_ADD(liveFrames, 1);
+    STAT_MAX(maxFrameDepth, (unsigned long long) threadState.frameDepth);
+
+    PROBE1(enter, threadState.frameDepth);
+}
+
+/*
+ * Pops the calling environment of the innermost try block. Returns whether
+ * an exception landed there, which is then stored in e.
+ */
+int popCallingEnv(Exception **e)
+{
+    ExFrame *frame = lastFrame;
+
+    assert(threadState.numCleanups == frame->cleanups);
+
+    lastFrame = frame->prev;
+    threadState.scratch = frame->scratch;
+    threadState.scratchUsed = frame->scratchUsed;
+    threadState.frameDepth--;
+    STAT_ADD(liveFrames, -1);
+
+    /* Without an exception the try block was left with continue. */
+    if (!e || !frame->exception)
+        return 0;
+
+    getExceptionEntry(frame->exception)->thrown = 0;
+    *e = frame->exception;
+
+    PROBE3(catch, frame->exception->code,
+           getExceptionEntry(frame->exception)->index,
+           threadState.frameDepth);
+
+    if (threadState.site)
+    {
+        __atomic_add_fetch(&threadState.site->cycles,
+                           readCycles() - threadState.siteStart,
+                           __ATOMIC_RELAXED);
+        threadState.site = NULL;
+    }
+
+    return 1;
+}
+
+void exInit()
+{
+    exInitEx(NULL);
+}
+
+void exInitEx(const ExConfig *config)
+{
+    uint32_t initial = DEFAULT_INITIAL_EXCEPTIONS;
+    uint32_t chunkSize = DEFAULT_CHUNK_EXCEPTIONS;
+    uint32_t max = DEFAULT_MAX_EXCEPTIONS;
+    ExceptionEntry *entry;
+
+    if (config && config->initialExceptions)
+        initial = config->initialExceptions;
+    if (config && config->chunkExceptions)
+        chunkSize = config->chunkExceptions;
+    if (config && config->maxExceptions)
+        max = config->maxExceptions;
+
+    lazyMessages = config && config->lazyMessages;
+
+    buildCodeHierarchy();
+
+    if (config && config->recorderSize)
+        mapRecorder(config);
+
+    backtraceSampling = config ? config->backtraceSampling : 0;
+    if (backtraceSampling)
+    {
+        void *frame;
+
+        /* The first call loads the unwinder, which allocates memory. */
+        backtrace(&frame, 1);
+    }
+
+    for (chunkShift = 0; (1u << chunkShift) < chunkSize; chunkShift++)
+        ;
+
+    chunkMask = (1u << chunkShift) - 1;
+    maxChunks = (max + chunkMask) >> chunkShift;
+    numChunks = 0;
+    chunks = calloc(maxChunks, sizeof(ExceptionEntry *));
+    backtraces = backtraceSampling ? calloc(maxChunks, sizeof(Backtrace *))
+                                   : NULL;
+    freeList.head = 0;
+
+    pthread_key_create(&threadKey, releaseThread);
+
+    while (numChunks << chunkShift < initial && (entry = addExceptionChunk()))
+        pushFreeEntries(entry, entry);
+}
+
+void exDeinit()
+{
+    uint32_t i;
+
+#ifndef NDEBUG
+
+    if (lastFrame)
+        printf("A calling environment was not freed. Did you exit a function from a try block?");
+
+    for (i = 0; i < numChunks << chunkShift; i++)
+    {
+        if (IS_USED(ENTRY(i)))
+        {
+            printf("An exception was not freed. The message is: %s.",
+                   exMsg(&ENTRY(i)->exception));
+        }
+    }
+#endif
+
+    releaseThread(&threadState);
+    pthread_key_delete(threadKey);
+
+    if (recorder)
+    {
+        munmap(recorder, recorderSize);
+        recorder = NULL;
+    }
+
+    for (i = 0; i < numChunks; i++)
+    {
+        free(chunks[i]);
+        if (backtraces)
+            free(backtraces[i]);
+    }
+
+    free(chunks);
+    free(backtraces);
+    chunks = NULL;
+    backtraces = NULL;
+    numChunks = 0;
+    freeList.head = 0;
+}
+
+/*
+ * Allocates an exception whose message is set by the caller.
+ */
+ExceptionEntry* newException(ExceptionCode code, Exception *cause)
+{
+    ExceptionEntry *entry = allocExceptionEntry();
+
+    setCause(entry, cause);
+    entry->exception.code = code;
+    memset(&entry->exception.data, 0, sizeof(ExData));
+
+    PROBE2(alloc, code, entry->index);
+
+    return entry;
+}
+
+ExceptionEntry* createException(ExceptionCode code,
+                                Exception *cause,
+                                const char *msg,
+                                va_list argList)
+{
+    ExceptionEntry *entry = newException(code, cause);
+
+    setMessage(entry, msg, argList);
+
+    return entry;
+}
+
+Exception* exAlloc(ExceptionCode code, Exception *cause, const char *msg, ...)
+{
+    ExceptionEntry *entry;
+    va_list argList;
+
+    va_start(argList, msg);
+    entry = createException(code, cause, msg, argList);
+    va_end(argList);
+
+    return &entry->exception;
+}
+
+/*
+ * Searches the calling environments of the thread for the innermost one
+ * handling the code of e, runs the cleanup handlers pushed inside the try
+ * blocks in between, releases all environments on top of it and jumps there.
+ */
+void jumpToHandler(Exception *e)
+{
+    ExFrame *frame;
+    Cleanup *cleanup;
+    int skipped = 0;
+
+    for (frame = lastFrame; frame; frame = frame->prev, skipped++)
+    {
+        if (EX_HANDLES(frame->codes, e->code) ||
+            (frame->kind >= 0 && exIsA(e->code, (ExceptionCode) frame->kind)))
+            break;
+    }
+
+    if (!frame)
+    {
+        fprintf(stderr, "Uncaught exception %s: %s\n",
+                exCodeName(e->code), exMsg(e));
+        abort();
+    }
+
+    while (threadState.numCleanups > frame->cleanups)
+    {
+        cleanup = &threadState.cleanups[--threadState.numCleanups];
+        cleanup->fn(cleanup->arg);
+    }
+
+    threadState.frameDepth -= skipped;
+    STAT_ADD(liveFrames, -skipped);
+
+    lastFrame = frame;
+    frame->exception = e;
+    EX_LONGJMP(frame->env);
+}
+
+void registerSite(ExSite *site)
+{
+    int unregistered = 0;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&site->registered, &unregistered, 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&sites, &site->next, site, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+/*
+ * Throws the exception in entry, which was thrown or rethrown at site if
+ * it isn't NULL and called from the address caller.
+ */
+void throwException(ExceptionEntry *entry,
+                    int rethrown,
+                    ExSite *site,
+                    const void *caller)
+{
+    entry->thrown = 1;
+
+    if (rethrown)
+    {
+        STAT_ADD(rethrows, 1);
+        PROBE3(rethrow, entry->exception.code, entry->index,
+               threadState.frameDepth);
+    }
+    else
+    {
+        STAT_ADD(throws, 1);
+        PROBE3(throw, entry->exception.code, entry->index,
+               threadState.frameDepth);
+    }
+
+    if (recorder)
+        recordThrow(entry, rethrown, caller);
+
+    if (backtraces && !rethrown &&
+        ++threadState.throwsSinceBacktrace >= backtraceSampling)
+    {
+        threadState.throwsSinceBacktrace = 0;
+        BACKTRACE(entry->index)->depth =
+            backtrace(BACKTRACE(entry->index)->frames, MAX_BACKTRACE_DEPTH);
+    }
+
+    if (site)
+    {
+        registerSite(site);
+        __atomic_add_fetch(rethrown ? &site->rethrows : &site->hits, 1,
+                           __ATOMIC_RELAXED);
+
+        threadState.site = site;
+        threadState.siteStart = readCycles();
+    }
+
+    jumpToHandler(&entry->exception);
+}
+
+void exThrow(ExceptionCode code, Exception *cause, const char *msg, ...)
+{
+    ExceptionEntry *entry;
+    va_list argList;
+
+    va_start(argList, msg);
+    entry = createException(code, cause, msg, argList);
+    va_end(argList);
+
+    throwException(entry, 0, NULL, __builtin_return_address(0));
+}
+
+void exThrowStatic(ExceptionCode code, Exception *cause, const char *msg)
+{
+    ExceptionEntry *entry = newException(code, cause);
+
+    entry->exception.msg = msg;
+
+    throwException(entry, 0, NULL, __builtin_return_address(0));
+}
+
+void exThrowData(ExceptionCode code,
+                 Exception *cause,
+                 const ExData *data,
+                 const char *msg, ...)
+{
+    ExceptionEntry *entry;
+    va_list argList;
+
+    va_start(argList, msg);
+    entry = createException(code, cause, msg, argList);
+    va_end(argList);
+
+    entry->exception.data = *data;
+
+    throwException(entry, 0, NULL, __builtin_return_address(0));
+}
+
+void exThrowAt(ExSite *site,
+               ExceptionCode code,
+               Exception *cause,
+               const char *msg, ...)
+{
+    ExceptionEntry *entry;
+    va_list argList;
+
+    va_start(argList, msg);
+    entry = createException(code, cause, msg, argList);
+    va_end(argList);
+
+    throwException(entry, 0, site, __builtin_return_address(0));
+}
+
+void exRethrow(Exception *e)
+{
+    ExceptionEntry *entry = getExceptionEntry(e);
+
+    assert(IS_USED(entry));
+    assert(!entry->thrown);
+
+    throwException(entry, 1, NULL, __builtin_return_address(0));
+}
+
+void exRethrowAt(ExSite *site, Exception *e)
+{
+    ExceptionEntry *entry = getExceptionEntry(e);
+
+    assert(IS_USED(entry));
+    assert(!entry->thrown);
+
+    throwException(entry, 1, site, __builtin_return_address(0));
+}
+
+Exception* exCapture(void (*fn)(void *), void *arg)
+{
+    Exception *e = NULL;
+    int scoped = threadState.scope.active;
+
+    /* The exception is handed off, possibly to another thread waiting for a
+     * task, so it must not belong to the scope of this thread. */
+    threadState.scope.active = 0;
+
+    try
+        fn(arg);
+    catch (e)
+    {
+    }
+
+    threadState.scope.active = scoped;
+
+    return e;
+}
+
+void exRethrowIn(Exception *e)
+{
+    if (e)
+        exRethrow(e);
+}
+
+const char* exMsg(Exception *e)
+{
+    ExceptionEntry *entry = getExceptionEntry(e);
+    ArenaChunk *argsChunk = entry->chunk;
+    const char *format;
+    char buf[MAX_MSG_LEN];
+    size_t len;
+
+    assert(IS_USED(entry));
+
+    if (entry->args)
+    {
+        memcpy(&format, entry->args, sizeof(const char *));
+        len = renderMessage(buf, format, entry->args + sizeof(const char *));
+        e->msg = arenaStore(buf, len + 1, &entry->chunk);
+        entry->args = NULL;
+
+        releaseArenaChunk(argsChunk);
+    }
+
+    return e->msg;
+}
+
+void exFree(Exception *e)
+{
+    ExceptionEntry *first = getExceptionEntry(e);
+    ExceptionEntry *entry;
+
+    assert(IS_USED(first));
+    assert(!first->cause);
+    assert(!first->thrown);
+
+    for (entry = first; entry; entry = entry->next)
+    {
+        assert(!entry->next ||
+               entry->next->generation == entry->causeGeneration);
+
+        PROBE2(free, entry->exception.code, entry->index);
+
+        if (entry->scoped)
+            unlinkScopeEntry(entry);
+
+        entry->generation++;
+        releaseArenaChunk(entry->chunk);
+    }
+
+    STAT_ADD(frees, first->length);
+    threadState.liveExceptions -= first->length;
+
+    freeExceptionEntries(first, first->tail, first->length);
+}
+
+const char* exCodeName(ExceptionCode code)
+{
+    return (unsigned) code < exNumCodes ? codeNames[code] : "unknown";
+}
+
+void* exScratchAlloc(size_t size)
+{
+    ScratchBlock *block = threadState.scratch;
+    ScratchBlock *next = block ? block->next : threadState.scratchBlocks;
+    size_t used = threadState.scratchUsed;
+
+    assert(lastFrame);
+
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t) (SCRATCH_ALIGN - 1);
+
+    if (!block || used + size > block->size)
+    {
+        /* A kept block which is too small stays behind the new one. */
+        if (!next || size > next->size)
+        {
+            next = malloc(sizeof(ScratchBlock) +
+                          (size > SCRATCH_BLOCK_SIZE ? size : SCRATCH_BLOCK_SIZE));
+            if (!next)
+            {
+                fprintf(stderr, "Out of memory for scratch allocations.\n");
+                abort();
+            }
+
+            next->size = size > SCRATCH_BLOCK_SIZE ? size : SCRATCH_BLOCK_SIZE;
+            next->next = block ? block->next : threadState.scratchBlocks;
+
+            if (block)
+                block->next = next;
+            else
+                threadState.scratchBlocks = next;
+        }
+
+        block = next;
+        used = 0;
+        threadState.scratch = block;
+    }
+
+    threadState.scratchUsed = used + size;
+    return block->data + used;
+}
+
+void exPushCleanup(void (*fn)(void *), void *arg)
+{
+    if (!threadState.cleanups)
+        threadState.cleanups = threadState.ownContext.storage;
+
+    if (threadState.numCleanups == MAX_CLEANUPS)
+    {
+        fprintf(stderr, "Too many cleanup handlers.\n");
+        abort();
+    }
+
+    threadState.cleanups[threadState.numCleanups].fn = fn;
+    threadState.cleanups[threadState.numCleanups].arg = arg;
+    threadState.numCleanups++;
+}
+
+void exPopCleanup(int run)
+{
+    Cleanup *cleanup;
+
+    assert(threadState.numCleanups > (lastFrame ? lastFrame->cleanups : 0));
+
+    cleanup = &threadState.cleanups[--threadState.numCleanups];
+    if (run)
+        cleanup->fn(cleanup->arg);
+}
+
+void exScopeBegin()
+{
+    Scope *scope = &threadState.scope;
+
+    assert(!scope->active);
+
+    registerThread();
+
+    scope->active = 1;
+    scope->lastFrame = lastFrame;
+    scope->liveFrames = threadState.stats.liveFrames;
+    scope->frameDepth = threadState.frameDepth;
+    scope->numCleanups = threadState.numCleanups;
+    scope->scratch = threadState.scratch;
+    scope->scratchUsed = threadState.scratchUsed;
+    scope->head = 0;
+}
+
+int exScopeEnd()
+{
+    Scope *scope = &threadState.scope;
+    ExceptionEntry *entry;
+    int reclaimed = 0;
+
+    assert(scope->active);
+
+#ifndef NDEBUG
+    if (lastFrame != scope->lastFrame)
+        fprintf(stderr, "A calling environment was not freed in the scope. "
+                        "Did you exit a function from a try block?\n");
+
+    if (threadState.numCleanups != scope->numCleanups)
+        fprintf(stderr, "A cleanup handler was not popped in the scope.\n");
+#endif
+
+    /* Frames left behind live in stack memory which is gone by now, so they
+     * are dropped without being read. */
+    STAT_ADD(liveFrames, scope->liveFrames - threadState.stats.liveFrames);
+    lastFrame = scope->lastFrame;
+    threadState.frameDepth = scope->frameDepth;
+    threadState.numCleanups = scope->numCleanups;
+    threadState.scratch = scope->scratch;
+    threadState.scratchUsed = scope->scratchUsed;
+
+    /* Freeing a chain unlinks all of its entries, so every round removes at
+     * least one. A cause stays with its chain, which is either freed from
+     * its outermost exception here or started outside the scope. */
+    while (scope->head)
+    {
+        entry = ENTRY(scope->head - 1);
+
+        if (entry->cause)
+        {
+            unlinkScopeEntry(entry);
+            continue;
+        }
+
+#ifndef NDEBUG
+        fprintf(stderr, "An exception was not freed in the scope. "
+                        "The message is: %s\n", exMsg(&entry->exception));
+#endif
+
+        reclaimed += entry->length;
+        exFree(&entry->exception);
+    }
+
+    scope->active = 0;
+
+    return reclaimed;
+}
+
+ExContext* exContextCreate()
+{
+    ExContext *context = calloc(1, sizeof(ExContext));
+
+    if (context)
+        context->cleanups = context->storage;
+
+    return context;
+}
+
+void exContextDestroy(ExContext *context)
+{
+    assert(context != threadState.context);
+    assert(!context->lastFrame);
+    assert(!context->numCleanups);
+
+    freeScratchBlocks(context->scratchBlocks);
+    free(context);
+}
+
+ExContext* exContextSwitch(ExContext *context)
+{
+    ExContext *prev = threadState.context;
+    ExContext *save = prev ? prev : &threadState.ownContext;
+    ExContext *load = context ? context : &threadState.ownContext;
+
+    save->lastFrame = lastFrame;
+    save->scratchBlocks = threadState.scratchBlocks;
+    save->scratch = threadState.scratch;
+    save->scratchUsed = threadState.scratchUsed;
+    save->cleanups = threadState.cleanups;
+    save->numCleanups = threadState.numCleanups;
+    save->frameDepth = threadState.frameDepth;
+
+    lastFrame = load->lastFrame;
+    threadState.scratchBlocks = load->scratchBlocks;
+    threadState.scratch = load->scratch;
+    threadState.scratchUsed = load->scratchUsed;
+    threadState.cleanups = load->cleanups;
+    threadState.numCleanups = load->numCleanups;
+    threadState.frameDepth = load->frameDepth;
+
+    threadState.context = context;
+    return prev;
+}
+
+int exBacktrace(Exception *e, FILE *out)
+{
+    ExceptionEntry *entry = getExceptionEntry(e);
+    Backtrace *trace;
+
+    assert(IS_USED(entry));
+
+    if (!backtraces || !BACKTRACE(entry->index)->depth)
+    {
+        fprintf(out, "No backtrace was captured.\n");
+        return 0;
+    }
+
+    trace = BACKTRACE(entry->index);
+
+    fflush(out);
+    backtrace_symbols_fd(trace->frames, trace->depth, fileno(out));
+
+    return trace->depth;
+}
+
+void exRecorderDump(FILE *out)
+{
+    if (recorder)
+        dumpRecorder(recorder, out);
+}
+
+int exRecorderDumpFile(const char *path, FILE *out)
+{
+    const RecorderHeader *header;
+    struct stat st;
+    void *map;
+    int fd, result = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(RecorderHeader))
+    {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    header = (const RecorderHeader *) map;
+
+    if (!memcmp(header->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) &&
+        (char *) RING(header, header->numRings) <= (char *) map + st.st_size)
+    {
+        dumpRecorder(header, out);
+        result = 0;
+    }
+
+    munmap(map, st.st_size);
+    return result;
+}
+
+int compareSites(const void *a, const void *b)
+{
+    const SiteCounters *siteA = (const SiteCounters *) a;
+    const SiteCounters *siteB = (const SiteCounters *) b;
+    unsigned long long throwsA = siteA->hits + siteA->rethrows;
+    unsigned long long throwsB = siteB->hits + siteB->rethrows;
+
+    if (siteA->cycles != siteB->cycles)
+        return siteA->cycles < siteB->cycles ? 1 : -1;
+
+    if (throwsA != throwsB)
+        return throwsA < throwsB ? 1 : -1;
+
+    return 0;
+}
+
+void exSiteReport(FILE *out, unsigned n)
+{
+    ExSite *head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    ExSite *site;
+    SiteCounters *sorted;
+    unsigned long long throws;
+    unsigned numSites = 0, i;
+
+    for (site = head; site; site = site->next)
+        numSites++;
+
+    sorted = malloc((numSites + 1) * sizeof(SiteCounters));
+    if (!sorted)
+        return;
+
+    /* Sites are registered in front of the head, so those registered in the
+     * meantime are left out. The counters keep changing on other threads,
+     * so they are sorted as read here. */
+    for (site = head, i = 0; i < numSites; i++, site = site->next)
+    {
+        sorted[i].site = site;
+        sorted[i].hits = __atomic_load_n(&site->hits, __ATOMIC_RELAXED);
+        sorted[i].rethrows = __atomic_load_n(&site->rethrows, __ATOMIC_RELAXED);
+        sorted[i].cycles = __atomic_load_n(&site->cycles, __ATOMIC_RELAXED);
+    }
+
+    qsort(sorted, numSites, sizeof(SiteCounters), compareSites);
+
+    if (!n || n > numSites)
+        n = numSites;
+
+    for (i = 0; i < n; i++)
+    {
+        throws = sorted[i].hits + sorted[i].rethrows;
+
+        fprintf(out, "%u. %s:%d: %llu throws, %llu rethrows, %llu cycles, %llu per throw\n",
+                i + 1, sorted[i].site->file, sorted[i].site->line,
+                sorted[i].hits, sorted[i].rethrows, sorted[i].cycles,
+                throws ? sorted[i].cycles / throws : 0);
+    }
+
+    free(sorted);
+}
+
+void exGetStats(ExStats *stats)
+{
+    ThreadState *state;
+
+    lockMutex();
+
+    *stats = retiredStats;
+
+    for (state = threadStates; state; state = state->next)
+        addStats(stats, &state->stats);
+
+    stats->liveExceptions = stats->allocs - stats->frees;
+    stats->poolExceptions =
+        (unsigned long long) __atomic_load_n(&numChunks, __ATOMIC_RELAXED) << chunkShift;
+    stats->maxExceptions = (unsigned long long) maxChunks << chunkShift;
+
+    pthread_mutex_unlock(&mutex);
+}
+
+#ifdef TEST
+
+#include <assert.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ucontext.h>
+
+typedef struct
+{
+    int used;
+    pthread_t id;
+    int secrets[3];
+} TestThread;
+
+#define NUM_THREADS 5
+#define NUM_SECONDS 10
+
+static TestThread testThreads[NUM_THREADS];
+static pthread_mutex_t testMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t testCond = PTHREAD_COND_INITIALIZER;
+static clock_t initTime;
+static clock_t lastTime;
+static int totalThreads;
+
+static void funcB(TestThread *thread)
+{
+    Exception *e;
+
+    try
+    {
+        try
+            exThrow(exOther, NULL, "No error.");
+        catch (e)
+        {
+            exFree(e);
+            e = exAlloc(exOther, NULL, "%d", thread->secrets[0]);
+            exThrow(exOther, e, "%d", thread->secrets[1]);
+        }
+    }
+    catch (e)
+        exRethrow(e);
+}
+
+static void* funcA(void *data)
+{
+    TestThread *thread = (TestThread *) data;
+    Exception *e;
+    char msgExpected[MAX_MSG_LEN];
+    char msgActual[MAX_MSG_LEN];
+
+    try
+    {
+        try
+            funcB(thread);
+        catch (e)
+        {
+            exThrow(exOther, e, "%s %d", e->msg, thread->secrets[2]);
+        }
+    }
+    catch (e)
+    {
+        snprintf(msgActual, MAX_MSG_LEN, "%s %s", e->cause->cause->msg, e->msg);
+        exFree(e);
+    }
+
+    pthread_mutex_lock(&testMutex);
+
+    /* Comparison inside the mutex since assert might not be thread-safe. */
+
+    snprintf(msgExpected,
+             MAX_MSG_LEN,
+             "%d %d %d",
+             thread->secrets[0],
+             thread->secrets[1],
+             thread->secrets[2]);
+    assert(!strcmp(msgExpected, msgActual));
+
+    assert(!lastFrame);
+
+    thread->used = 0;
+    pthread_cond_signal(&testCond);
+    pthread_mutex_unlock(&testMutex);
+
+    return NULL;
+}
+
+#define CHECK_LAZY_MSG(...)                             \
+    do                                                  \
+    {                                                   \
+        snprintf(msgExpected, MAX_MSG_LEN, __VA_ARGS__);\
+        e = exAlloc(exOther, NULL, __VA_ARGS__);        \
+        assert(!strcmp(msgExpected, exMsg(e)));         \
+        exFree(e);                                      \
+    } while (0)
+
+static void testLazyMessages()
+{
+    ExConfig config = { 0 };
+    Exception *e;
+    char msgExpected[MAX_MSG_LEN];
+    char str[16];
+    long long big = -1234567890123LL;
+    const char *volatile none = NULL;
+    char *token;
+
+    config.lazyMessages = 1;
+    exInitEx(&config);
+
+    CHECK_LAZY_MSG("No arguments, 100%% literal.");
+    CHECK_LAZY_MSG("%d %5i %-5u| %hhd %hu %lx %llX %jd %zu %td %o %#x",
+                   -42, 7, 3u, (signed char) -3, (unsigned short) 65535,
+                   0xdeadbeefUL, (unsigned long long) big, (intmax_t) big,
+                   (size_t) 99, (ptrdiff_t) -5, 8, 255);
+    CHECK_LAZY_MSG("%*d|%-*d|%.*f|%*.*e|%.*s",
+                   6, 1, -6, 2, 3, 3.14159, 12, 2, 1e10, -1, "whole");
+    CHECK_LAZY_MSG("%c%c %g %Lf %p %s", 'o', 'k', 0.5, (long double) 2.5,
+                   (void *) &e, "");
+
+    /* Strings are copied, so the buffer can change before the message is
+     * read. */
+
+    strcpy(str, "before");
+    e = exAlloc(exOther, NULL, "[%s]", str);
+    strcpy(str, "after");
+    assert(!strcmp(exMsg(e), "[before]"));
+    exFree(e);
+
+    /* So is the format. */
+
+    strcpy(str, "[%d]");
+    e = exAlloc(exOther, NULL, str, 5);
+    strcpy(str, "changed %d!!");
+    assert(!strcmp(exMsg(e), "[5]"));
+    exFree(e);
+
+    /* Only as much of a string as its precision allows is read, so it
+     * needn't be terminated. */
+
+    token = malloc(8);
+    memcpy(token, "tokenize", 8);
+    CHECK_LAZY_MSG("token '%.*s' '%.5s' '%.*s'", 4, token, token, -1, "all");
+    free(token);
+
+    /* Unsupported conversions and NULL strings are formatted right away. */
+
+    CHECK_LAZY_MSG("%1$d", 5);
+    CHECK_LAZY_MSG("[%s]", none);
+
+    try
+        exThrow(exOther, NULL, "Lazy %s %d.", "throw", 1);
+    catch (e)
+    {
+        assert(!strcmp(exMsg(e), "Lazy throw 1."));
+        exFree(e);
+    }
+
+    exDeinit();
+}
+
+static void testFilteredCatch()
+{
+    Exception *e;
+    volatile int skipped = 1;
+
+    exInit();
+
+    try
+    {
+        try
+        {
+            try
+                exThrow(exOther, NULL, "Filtered.");
+            catch_codes (e, 0)
+                skipped = 0;
+        }
+        catch_codes (e, ~EX_CODE_BIT(exOther))
+            skipped = 0;
+    }
+    catch_codes (e, EX_CODE_BIT(exOther))
+    {
+        assert(!strcmp(e->msg, "Filtered."));
+        exFree(e);
+    }
+
+    assert(skipped);
+    assert(!lastFrame);
+
+    exDeinit();
+}
+
+static void testUncaught()
+{
+    Exception *e;
+    pid_t pid;
+    int status;
+
+    /* An exception which no try block handles aborts, also with NDEBUG. */
+    if (!(pid = fork()))
+    {
+        freopen("/dev/null", "w", stderr);
+        exInit();
+
+        try
+            exThrow(exOther, NULL, "Uncaught.");
+        catch_codes (e, 0)
+            exFree(e);
+
+        _exit(0);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void testContinue()
+{
+    Exception *e;
+    int i, n = 0;
+
+    exInit();
+
+    /* continue leaves the try-catch statement and pops the environment. */
+    for (i = 0; i < 3; i++)
+    {
+        try
+        {
+            n++;
+            continue;
+        }
+        catch (e)
+            exFree(e);
+    }
+
+    assert(n == 3);
+    assert(!lastFrame);
+
+    exDeinit();
+}
+
+static void testScratch()
+{
+    Exception *e;
+    char *volatile outer;
+    char *volatile inner;
+    char *big;
+
+    exInit();
+
+    try
+    {
+        outer = exScratchAlloc(10);
+        strcpy(outer, "outer");
+
+        try
+        {
+            inner = exScratchAlloc(100);
+            big = exScratchAlloc(SCRATCH_BLOCK_SIZE * 2);
+            memset(big, 0, SCRATCH_BLOCK_SIZE * 2);
+            exThrow(exOther, NULL, "Unwound.");
+        }
+        catch (e)
+            exFree(e);
+
+        /* The throw released the memory of the inner try block. */
+        assert(exScratchAlloc(100) == inner);
+        assert(!strcmp(outer, "outer"));
+        assert((uintptr_t) inner % SCRATCH_ALIGN == 0);
+
+        try
+            inner = exScratchAlloc(SCRATCH_BLOCK_SIZE);
+        catch (e)
+            exFree(e);
+
+        assert(exScratchAlloc(SCRATCH_BLOCK_SIZE) == inner);
+    }
+    catch (e)
+        exFree(e);
+
+    try
+        assert(exScratchAlloc(10) == outer);
+    catch (e)
+        exFree(e);
+
+    exDeinit();
+}
+
+static int cleanupOrder[4];
+static int numCleanupsRun;
+
+static void recordCleanup(void *arg)
+{
+    cleanupOrder[numCleanupsRun++] = *(int *) arg;
+}
+
+static void testCleanups()
+{
+    static int ids[] = { 0, 1, 2, 3 };
+    Exception *e;
+
+    exInit();
+
+    exPushCleanup(recordCleanup, &ids[0]);
+
+    try
+    {
+        exPushCleanup(recordCleanup, &ids[1]);
+
+        try
+        {
+            exPushCleanup(recordCleanup, &ids[2]);
+            exPushCleanup(recordCleanup, &ids[3]);
+            exPopCleanup(0);
+            exThrow(exOther, NULL, "Unwound.");
+        }
+        catch_codes (e, 0)
+        {
+        }
+    }
+    catch (e)
+    {
+        /* Both try blocks were left, their handlers ran innermost first. */
+        assert(numCleanupsRun == 2);
+        assert(cleanupOrder[0] == 2);
+        assert(cleanupOrder[1] == 1);
+        exFree(e);
+    }
+
+    exPopCleanup(1);
+    assert(numCleanupsRun == 3);
+    assert(cleanupOrder[2] == 0);
+    assert(!threadState.numCleanups);
+
+    exDeinit();
+}
+
+static void throwInWorker(void *arg)
+{
+    Exception *e;
+
+    try
+        exThrow(exOther, NULL, "Cause in worker %d.", *(int *) arg);
+    catch (e)
+        exThrow(exOther, e, "Failure in worker %d.", *(int *) arg);
+}
+
+static void* captureInWorker(void *arg)
+{
+    return exCapture(throwInWorker, arg);
+}
+
+static void testCapture()
+{
+    pthread_t worker;
+    Exception *e, *captured;
+    const char *msg;
+    int id = 7;
+
+    exInit();
+
+    pthread_create(&worker, NULL, captureInWorker, &id);
+    pthread_join(worker, (void **) &captured);
+
+    assert(captured);
+    msg = captured->msg;
+
+    try
+    {
+        exRethrowIn(NULL);
+        exRethrowIn(captured);
+    }
+    catch (e)
+    {
+        /* The very exception thrown in the worker, message and cause. */
+        assert(e == captured);
+        assert(e->msg == msg);
+        assert(!strcmp(e->msg, "Failure in worker 7."));
+        assert(!strcmp(e->cause->msg, "Cause in worker 7."));
+        exFree(e);
+    }
+
+    assert(!exCapture(recordCleanup, &id));
+
+    exDeinit();
+}
+
+#define FIBER_STACK_SIZE 65536
+
+typedef struct
+{
+    ucontext_t ucontext;
+    ExContext *context;
+    const char *name;
+    int caught;
+} Fiber;
+
+static ucontext_t mainUcontext;
+static Fiber fibers[2];
+
+/* Switches from the fiber at index from to the other one. */
+static void yieldFiber(int from)
+{
+    exContextSwitch(fibers[!from].context);
+    swapcontext(&fibers[from].ucontext, &fibers[!from].ucontext);
+}
+
+static void runFiber(int index)
+{
+    Fiber *fiber = &fibers[index];
+    Exception *e;
+
+    try
+    {
+        yieldFiber(index);
+        exThrow(exOther, NULL, "%s", fiber->name);
+    }
+    catch (e)
+    {
+        /* Each throw lands in the try block of its own fiber. */
+        assert(!strcmp(e->msg, fiber->name));
+        fiber->caught++;
+        exFree(e);
+    }
+
+    exContextSwitch(NULL);
+}
+
+static void testContexts()
+{
+    static char stacks[2][FIBER_STACK_SIZE];
+    int i;
+
+    exInit();
+
+    for (i = 0; i < 2; i++)
+    {
+        fibers[i].context = exContextCreate();
+        fibers[i].name = i ? "second" : "first";
+        fibers[i].caught = 0;
+
+        getcontext(&fibers[i].ucontext);
+        fibers[i].ucontext.uc_stack.ss_sp = stacks[i];
+        fibers[i].ucontext.uc_stack.ss_size = FIBER_STACK_SIZE;
+        fibers[i].ucontext.uc_link = &mainUcontext;
+        makecontext(&fibers[i].ucontext, (void (*)()) runFiber, 1, i);
+    }
+
+    /*
+     * The first fiber enters its try block and yields, the second one enters
+     * its own, yields back, the first one throws and finishes, the second one
+     * resumes, throws and finishes.
+     */
+    exContextSwitch(fibers[0].context);
+    swapcontext(&mainUcontext, &fibers[0].ucontext);
+    exContextSwitch(fibers[1].context);
+    swapcontext(&mainUcontext, &fibers[1].ucontext);
+
+    assert(fibers[0].caught == 1);
+    assert(fibers[1].caught == 1);
+    assert(!lastFrame);
+
+    for (i = 0; i < 2; i++)
+        exContextDestroy(fibers[i].context);
+
+    exDeinit();
+}
 
-static EnvEntry envList[ENV_LIST_SIZE];
-static ExceptionEntry exceptionList[EXCEPTION_LIST_SIZE];
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Reads a whole file into buf, which has room for size characters. */
+static void readAll(FILE *file, char *buf, size_t size)
+{
+    size_t len;
+
+    rewind(file);
+    len = fread(buf, 1, size - 1, file);
+    buf[len] = '\0';
+}
 
-EnvEntry* getLastEnvEntry(pthread_t thread)
+static void testRecorder()
 {
-    EnvEntry *entry, *last = NULL;
-    int i;
+    ExConfig config = { 0 };
+    char path[] = "/tmp/exrecXXXXXX";
+    char live[4096], saved[4096];
+    FILE *out;
+    Exception *e;
+    int fd, i;
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
 
-    for (i = ENV_LIST_SIZE - 1; i >= 0; i--)
+    config.recorderSize = 4;
+    config.recorderFile = path;
+    exInitEx(&config);
+
+    for (i = 0; i < 5; i++)
     {
-        entry = &envList[i];
+        try
+            exThrow(exOther, NULL, "Recorded %d.", i);
+        catch (e)
+            exFree(e);
+    }
 
-        if (entry->used && entry->thread == thread)
-        {
-            if (!last || entry->level > last->level)
-                last = entry;
-        }
+    try
+    {
+        try
+            exThrow(exOther, NULL, "Recorded %d.", i);
+        catch (e)
+            exRethrow(e);
     }
+    catch (e)
+        exFree(e);
 
-    return last;
-}
+    /* The ring keeps the latest 4 throws: 3, 4, and 5 twice. */
+    out = tmpfile();
+    exRecorderDump(out);
+    readAll(out, live, sizeof(live));
+    fclose(out);
 
-ExceptionEntry* getExceptionEntry(Exception *e)
-{
-    ExceptionEntry *entry;
+    assert(!strstr(live, "Recorded 2."));
+    assert(strstr(live, "Recorded 3."));
+    assert(strstr(live, " threw code 0") < strstr(live, " rethrew code 0"));
+    assert(strstr(strstr(live, "Recorded 5."), "Recorded 5."));
 
-    for (entry = exceptionList; entry; entry = entry->next)
-    {
-        if (&entry->exception == e)
-            break;
-    }
+    exDeinit();
 
-    return entry;
+    /* The file keeps the records after the recorder is gone. */
+    out = tmpfile();
+    assert(!exRecorderDumpFile(path, out));
+    readAll(out, saved, sizeof(saved));
+    fclose(out);
+
+    assert(!strcmp(live, saved));
+    assert(exRecorderDumpFile("/nonexistent", stdout) == -1);
+
+    unlink(path);
 }
 
-ExceptionEntry* allocExceptionEntry()
+static void throwAtSites(int rethrow)
 {
-    ExceptionEntry *entry;
+    Exception *e;
 
-    for (entry = exceptionList; entry; entry = entry->next)
+    try
     {
-        if (!entry->used)
+        try
+            EX_THROW(exOther, NULL, "Site %d.", rethrow);
+        catch (e)
         {
-            entry->cause = 0;
-            entry->used = 1;
-            break;
+            if (rethrow)
+                EX_RETHROW(e);
+            exFree(e);
         }
     }
-
-    return entry;
+    catch (e)
+        exFree(e);
 }
 
-jmp_buf* pushCallingEnv()
+static void testSites()
 {
-    pthread_t thread = pthread_self();
-    EnvEntry *entry, *unused = NULL;
-    int level = 0;
+    char report[4096], expected[256];
+    FILE *out;
+    size_t len;
+    int i;
 
-    pthread_mutex_lock(&mutex);
+    exInit();
 
-    for (entry = envList; entry; entry = entry->next)
-    {
-        if (!unused && !entry->used)
-            unused = entry;
-        else if (entry->used && entry->thread == thread)
-            level++;
-    }
+    for (i = 0; i < 3; i++)
+        throwAtSites(i == 2);
 
-    unused->used = 1;
-    unused->level = level;
-    unused->thread = thread;
+    out = tmpfile();
+    exSiteReport(out, 0);
+    rewind(out);
+    len = fread(report, 1, sizeof(report) - 1, out);
+    report[len] = '\0';
+    fclose(out);
 
-    pthread_mutex_unlock(&mutex);
-    return &unused->env;
+    /* The EX_THROW and the EX_RETHROW in throwAtSites. */
+    snprintf(expected, sizeof(expected), "%s:", __FILE__);
+    assert(strstr(report, expected) == strchr(report, ' ') + 1);
+    assert(strstr(report, ": 3 throws, 0 rethrows"));
+    assert(strstr(report, ": 0 throws, 1 rethrows"));
+
+    out = tmpfile();
+    exSiteReport(out, 1);
+    assert(ftell(out) > 0 && ftell(out) < (long) len);
+    fclose(out);
+
+    exDeinit();
 }
 
-void popCallingEnv(Exception **e)
+static void throwTraced(int i)
 {
-    pthread_t thread = pthread_self();
-    ExceptionEntry *entry;
+    exThrow(exOther, NULL, "Traced %d.", i);
+}
 
-    pthread_mutex_lock(&mutex);
+static void testBacktraces()
+{
+    ExConfig config = { 0 };
+    Exception *e;
+    FILE *out;
+    volatile int traced = 0;
+    int i;
 
-    getLastEnvEntry(thread)->used = 0;
+    config.backtraceSampling = 3;
+    exInitEx(&config);
 
-    for (entry = exceptionList; entry; entry = entry->next)
+    /* Every third throw is captured. */
+    for (i = 0; i < 6; i++)
     {
-        if (entry->used && entry->thrown && entry->thread == thread)
+        try
+            throwTraced(i);
+        catch (e)
         {
-            entry->thrown = 0;
-            pthread_mutex_unlock(&mutex);
-
-            *e = &entry->exception;
-            return;
+            out = tmpfile();
+            if (exBacktrace(e, out))
+            {
+                assert(ftell(out) > 0);
+                traced++;
+            }
+            fclose(out);
+            exFree(e);
         }
     }
 
-    pthread_mutex_unlock(&mutex);
+    assert(traced == 2);
+
+    e = exAlloc(exOther, NULL, "Not thrown.");
+    out = tmpfile();
+    assert(!exBacktrace(e, out));
+    fclose(out);
+    exFree(e);
+
+    exDeinit();
 }
 
-void exInit()
+static void testData()
 {
-    int i;
+    ExData data = { 0 };
+    Exception *e;
+
+    exInit();
+
+    data.value = -1;
+    data.offset = (int64_t) 1 << 40;
+    data.errnum = 2;
+    data.fields = EX_DATA_VALUE | EX_DATA_OFFSET | EX_DATA_ERRNUM;
 
-    envList[ENV_LIST_SIZE - 1].next = NULL;
-    for (i = 1; i < ENV_LIST_SIZE; i++)
-        envList[i - 1].next = &envList[i];
+    try
+    {
+        try
+            exThrow(exOther, NULL, "Without data.");
+        catch (e)
+            exThrowData(exOther, e, &data, "With data at %lld.",
+                        (long long) data.offset);
+    }
+    catch (e)
+    {
+        assert(e->data.fields == data.fields);
+        assert(e->data.value == -1);
+        assert(e->data.offset == (int64_t) 1 << 40);
+        assert(e->data.errnum == 2);
+        assert(!e->cause->data.fields);
+        assert(!e->cause->data.value && !e->cause->data.ptr);
+        exFree(e);
+    }
 
-    exceptionList[ENV_LIST_SIZE - 1].next = NULL;
-    for (i = 1; i < EXCEPTION_LIST_SIZE; i++)
-        exceptionList[i - 1].next = &exceptionList[i];
+    exDeinit();
 }
 
-void exDeinit()
+static void testStaticMessages()
 {
-#ifndef NDEBUG
-    int i;
+    static const char msg[] = "Borrowed, 100% unformatted.";
+    ExConfig config = { 0 };
+    Exception *e;
+    volatile int lazy;
 
-    for (i = 0; i < ENV_LIST_SIZE; i++)
+    for (lazy = 0; lazy < 2; lazy++)
     {
-        if (envList[i].used)
-            printf("A calling environment was not freed. Did you exit a function from a try block?");
-    }
+        config.lazyMessages = lazy;
+        exInitEx(&config);
 
-    for (i = 0; i < EXCEPTION_LIST_SIZE; i++)
-    {
-        if (exceptionList[i].used)
+        try
         {
-            exceptionList[i].exception.msg[MAX_MSG_LEN - 1] = '\0';
-            printf("An exception was not freed. The message is: %s.",
-                   exceptionList[i].exception.msg);
+            try
+                exThrowStatic(exOther, NULL, msg);
+            catch (e)
+            {
+                assert(e->msg == msg);
+                assert(!getExceptionEntry(e)->chunk);
+                exThrow(exOther, e, "Formatted %d.", lazy);
+            }
+        }
+        catch (e)
+        {
+            assert(e->cause->msg == msg);
+            assert(exMsg(e->cause) == msg);
+            assert(!strcmp(exMsg(e), lazy ? "Formatted 1." : "Formatted 0."));
+            exFree(e);
         }
+
+        exDeinit();
     }
-#endif
 }
 
-Exception* exAlloc(ExceptionCode code, Exception *cause, const char *msg, ...)
+static void testCodeHierarchy()
 {
-    ExceptionEntry *entry;
     Exception *e;
-    va_list argList;
+    volatile int landed = 0;
 
-    pthread_mutex_lock(&mutex);
+    exInit();
 
-    assert(!cause || getExceptionEntry(cause)->used);
-    assert(!cause || !getExceptionEntry(cause)->cause);
-    assert(!cause || !getExceptionEntry(cause)->thrown);
+    assert(exIsA(exTestNotFound, exTestIO));
+    assert(exIsA(exTestNotFound, exTestFile));
+    assert(exIsA(exTestNotFound, exTestNotFound));
+    assert(exIsA(exTestPipe, exTestIO));
+    assert(!exIsA(exTestPipe, exTestFile));
+    assert(!exIsA(exTestIO, exTestFile));
+    assert(!exIsA(exTestParse, exTestIO));
+    assert(!exIsA(exOther, exTestIO));
+    assert(!strcmp(exCodeName(exTestNotFound), "exTestNotFound"));
+    assert(!strcmp(exCodeName(exNumCodes), "unknown"));
 
-    entry = allocExceptionEntry();
-    if (cause)
-        getExceptionEntry(cause)->cause = 1;
+    try
+    {
+        try
+        {
+            try
+                exThrow(exTestNotFound, NULL, "Missing.");
+            catch_kind (e, exTestPipe)
+                landed = 1;
+        }
+        catch_kind (e, exTestFile)
+        {
+            assert(e->code == exTestNotFound);
+            landed = 2;
+            exThrow(exTestParse, e, "Unparsable.");
+        }
+    }
+    catch_kind (e, exTestParse)
+    {
+        assert(landed == 2);
+        exFree(e);
+    }
 
-    pthread_mutex_unlock(&mutex);
+    exDeinit();
+}
 
-    e = &entry->exception;
-    e->code = code;
-    *((Exception **) &e->cause) = cause;
+static void wrapLayers(int level)
+{
+    Exception *e;
 
-    va_start(argList, msg);
-    vsnprintf(e->msg, MAX_MSG_LEN, msg, argList);
-    va_end(argList);
+    if (!level)
+        exThrowStatic(exOther, NULL, "Bottom layer.");
 
-    return e;
+    try
+        wrapLayers(level - 1);
+    catch (e)
+        exThrow(exOther, e, "Layer %d.", level);
 }
 
-void exThrow(ExceptionCode code, Exception *cause, const char *msg, ...)
+static void testDeepChains()
 {
-    ExceptionEntry *entry;
-    Exception *e;
-    jmp_buf *env;
-    pthread_t thread = pthread_self();
-    va_list argList;
+    ExStats before, after;
+    Exception *e, *cause;
+    uint32_t i;
+    int depth;
 
-    pthread_mutex_lock(&mutex);
+    exInit();
 
-    assert(!cause || getExceptionEntry(cause)->used);
-    assert(!cause || !getExceptionEntry(cause)->cause);
-    assert(!cause || !getExceptionEntry(cause)->thrown);
+    try
+        wrapLayers(6);
+    catch (e)
+    {
+        for (cause = e, depth = 0; cause->cause; cause = cause->cause)
+            depth++;
 
-    entry = allocExceptionEntry();
-    entry->thrown = 1;
-    entry->thread = thread;
-    if (cause)
-        getExceptionEntry(cause)->cause = 1;
+        assert(depth == 6);
+        assert(!strcmp(e->msg, "Layer 6."));
+        assert(!strcmp(cause->msg, "Bottom layer."));
+        assert(getExceptionEntry(e)->tail == getExceptionEntry(cause));
+        exFree(e);
+    }
 
-    env = &getLastEnvEntry(thread)->env;
+    /* Longer than a magazine, so the chain goes to the shared free list. */
+    exGetStats(&before);
 
-    pthread_mutex_unlock(&mutex);
+    for (e = NULL, i = 0; i < 10 * MAGAZINE_SIZE; i++)
+        e = exAlloc(exOther, e, "Link %u.", i);
 
-    e = &entry->exception;
-    e->code = code;
-    *((Exception **) &e->cause) = cause;
+    assert(getExceptionEntry(e)->length == 10 * MAGAZINE_SIZE);
+    exFree(e);
 
-    va_start(argList, msg);
-    vsnprintf(e->msg, MAX_MSG_LEN, msg, argList);
-    va_end(argList);
+    exGetStats(&after);
+    assert(after.frees - before.frees == 10 * MAGAZINE_SIZE);
+
+    for (i = 0; i < numChunks << chunkShift; i++)
+        assert(!IS_USED(ENTRY(i)));
 
-    longjmp(*env, 1);
+    exDeinit();
 }
 
-void exRethrow(Exception *e)
+static void leaveTryBlock()
 {
-    ExceptionEntry *entry = getExceptionEntry(e);
-    pthread_t thread = pthread_self();
-    jmp_buf *env;
-
-    pthread_mutex_lock(&mutex);
+    Exception *e;
 
-    assert(entry->used);
-    assert(!entry->thrown);
+    try
+        return;
+    catch (e)
+        exFree(e);
+}
 
-    entry->thrown = 1;
-    entry->thread = thread;
+static void throwCaptured(void *arg)
+{
+    (void) arg;
+    exThrowStatic(exOther, NULL, "Captured.");
+}
 
-    env = &getLastEnvEntry(thread)->env;
+static void testScopes()
+{
+    ExStats before, after;
+    Exception *e, *outer, *kept;
+    volatile int n;
+    uint32_t i;
 
-    pthread_mutex_unlock(&mutex);
+    exInit();
 
-    longjmp(*env, 1);
-}
+    outer = exAlloc(exOther, NULL, "Outside.");
+    kept = exAlloc(exOther, NULL, "Cause outside.");
 
-void exFree(Exception *e)
-{
-    pthread_mutex_lock(&mutex);
+    exGetStats(&before);
+    exScopeBegin();
 
-    assert(getExceptionEntry(e)->used);
-    assert(!getExceptionEntry(e)->cause);
-    assert(!getExceptionEntry(e)->thrown);
+    /* Forgotten: a chain with a cause from outside the scope, a caught
+     * exception, a try block left with return and a cleanup handler. */
+    exAlloc(exOther, exAlloc(exOther, kept, "Middle."), "Root.");
 
-    for (; e; e = e->cause)
-        getExceptionEntry(e)->used = 0;
+    try
+        exThrowStatic(exOther, NULL, "Caught.");
+    catch (e)
+    {
+    }
 
-    pthread_mutex_unlock(&mutex);
-}
+    leaveTryBlock();
+    exPushCleanup(free, NULL);
 
-#ifdef TEST
+    /* Freed: an exception from the scope and one from outside. */
+    exFree(exAlloc(exOther, NULL, "Freed."));
+    exFree(outer);
 
-#include <assert.h>
-#include <time.h>
+    assert(exScopeEnd() == 4);
 
-typedef struct
-{
-    int used;
-    pthread_t id;
-    int secrets[3];
-} TestThread;
+    exGetStats(&after);
+    assert(after.liveFrames == before.liveFrames);
+    assert(after.frees - before.frees == 6);
+    assert(!lastFrame);
+    assert(!threadState.numCleanups);
 
-#define NUM_THREADS 5
-#define NUM_SECONDS 10
+    for (i = 0; i < numChunks << chunkShift; i++)
+        assert(!IS_USED(ENTRY(i)));
 
-static TestThread testThreads[NUM_THREADS];
-static pthread_mutex_t testMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t testCond = PTHREAD_COND_INITIALIZER;
-static clock_t initTime;
-static clock_t lastTime;
-static int totalThreads;
+    /* Captured exceptions are handed off and don't belong to the scope. */
+    exScopeBegin();
+    e = exCapture(throwCaptured, NULL);
+    assert(exScopeEnd() == 0);
+    assert(!strcmp(e->msg, "Captured."));
+    exFree(e);
 
-static void funcB(TestThread *thread)
-{
-    Exception *e;
-    EnvEntry *entry;
-    int i = 0;
+    /* The scope can be used again. Freed exceptions don't stay in it. */
+    exScopeBegin();
 
-    try
+    for (n = 0; n < 1000; n++)
     {
         try
-            exThrow(exOther, NULL, "No error.");
+            exThrowStatic(exOther, NULL, "Freed.");
         catch (e)
-        {
             exFree(e);
-            e = exAlloc(exOther, NULL, "%d", thread->secrets[0]);
-            exThrow(exOther, e, "%d", thread->secrets[1]);
-        }
     }
-    catch (e)
-        exRethrow(e);
+
+    assert(!threadState.scope.head);
+    assert(exScopeEnd() == 0);
+
+    exDeinit();
 }
 
-static void* funcA(void *data)
+static void testStats()
 {
-    TestThread *thread = (TestThread *) data;
+    ExStats before, after;
     Exception *e;
-    char msgExpected[MAX_MSG_LEN];
-    char msgActual[MAX_MSG_LEN];
+
+    exInit();
+    exGetStats(&before);
 
     try
     {
         try
-            funcB(thread);
+            exThrow(exOther, NULL, "Counted.");
         catch (e)
-        {
-            snprintf(e->msg + strlen(e->msg), MAX_MSG_LEN, " %d", thread->secrets[2]);
             exRethrow(e);
-        }
     }
     catch (e)
-    {
-        snprintf(msgActual, MAX_MSG_LEN, "%s %s", e->cause->msg, e->msg);
         exFree(e);
-    }
 
-    pthread_mutex_lock(&testMutex);
+    exFree(exAlloc(exOther, NULL, "Counted."));
+    exGetStats(&after);
 
-    /* Comparison inside the mutex since assert might not be thread-safe. */
+    assert(after.tryFrames - before.tryFrames == 2);
+    assert(after.throws - before.throws == 1);
+    assert(after.rethrows - before.rethrows == 1);
+    assert(after.allocs - before.allocs == 2);
+    assert(after.frees - before.frees == 2);
+    assert(after.liveExceptions == before.liveExceptions);
+    assert(after.liveFrames == before.liveFrames);
+    assert(after.maxFrameDepth >= 2);
+    assert(after.poolExceptions >= 1);
 
-    snprintf(msgExpected,
-             MAX_MSG_LEN,
-             "%d %d %d",
-             thread->secrets[0],
-             thread->secrets[1],
-             thread->secrets[2]);
-    assert(!strcmp(msgExpected, msgActual));
+    exDeinit();
+}
 
-    thread->used = 0;
-    pthread_cond_signal(&testCond);
-    pthread_mutex_unlock(&testMutex);
+static void* leaveMigratedFrame(void *context)
+{
+    ExFrame frame;
+
+    /* Leaves the try blocks entered on the main thread, then enters and
+     * leaves another one with the thread's own counter below zero. */
+    exContextSwitch((ExContext *) context);
+    popCallingEnv(NULL);
+    popCallingEnv(NULL);
+    pushCallingEnv(&frame);
+    popCallingEnv(NULL);
+    exContextSwitch(NULL);
 
     return NULL;
 }
 
+static void testMigratedFrames()
+{
+    ExStats before, after;
+    ExContext *context;
+    ExFrame frames[2];
+    pthread_t thread;
+
+    exInit();
+    exGetStats(&before);
+
+    context = exContextCreate();
+    exContextSwitch(context);
+    pushCallingEnv(&frames[0]);
+    pushCallingEnv(&frames[1]);
+    exContextSwitch(NULL);
+
+    pthread_create(&thread, NULL, leaveMigratedFrame, context);
+    pthread_join(thread, NULL);
+
+    exGetStats(&after);
+    assert(after.liveFrames == before.liveFrames);
+    assert(after.maxFrameDepth < 100);
+
+    exContextDestroy(context);
+    exDeinit();
+}
+
 int main(void)
 {
     int i;
@@ -426,15 +3214,67 @@ int main(void)
         pthread_join(testThreads[i].id, NULL);
     pthread_cond_destroy(&testCond);
 
-    for (i = 0; i < ENV_LIST_SIZE; i++)
-        assert(!envList[i].used);
-
-    for (i = 0; i < EXCEPTION_LIST_SIZE; i++)
-        assert(!exceptionList[i].used);
+    for (i = 0; i < (int) (numChunks << chunkShift); i++)
+        assert(!IS_USED(ENTRY(i)));
 
     printf("Successfully tested with %d threads.\n\n", totalThreads);
 
     exDeinit();
+
+    testLazyMessages();
+    printf("Successfully tested lazy message formatting.\n");
+
+    testFilteredCatch();
+    printf("Successfully tested filtered catch blocks.\n");
+
+    testUncaught();
+    printf("Successfully tested uncaught exceptions.\n");
+
+    testContinue();
+    printf("Successfully tested continue in a try block.\n");
+
+    testScratch();
+    printf("Successfully tested scratch memory.\n");
+
+    testCleanups();
+    printf("Successfully tested cleanup handlers.\n");
+
+    testCapture();
+    printf("Successfully tested capturing exceptions on other threads.\n");
+
+    testContexts();
+    printf("Successfully tested contexts of fibers.\n");
+
+    testRecorder();
+    printf("Successfully tested the flight recorder.\n");
+
+    testSites();
+    printf("Successfully tested throw site counters.\n");
+
+    testBacktraces();
+    printf("Successfully tested backtraces.\n");
+
+    testData();
+    printf("Successfully tested exception data.\n");
+
+    testStaticMessages();
+    printf("Successfully tested static messages.\n");
+
+    testCodeHierarchy();
+    printf("Successfully tested the code hierarchy.\n");
+
+    testDeepChains();
+    printf("Successfully tested deep chains.\n");
+
+    testScopes();
+    printf("Successfully tested scopes.\n");
+
+    testStats();
+    printf("Successfully tested statistics.\n");
+
+    testMigratedFrames();
+    printf("Successfully tested frames of migrated fibers.\n");
+
     fflush(stdout);
 
     return 0;
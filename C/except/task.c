@@ -0,0 +1,533 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mihail Ivanchev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "task.h"
+
+#define DEQUE_SIZE 1024
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+#define CACHE_LINE_SIZE 64
+
+/*
+ * The queue of a worker thread, a Chase-Lev deque of fixed capacity. The
+ * owner pushes and pops tasks at the bottom, other threads steal them from
+ * the top. Only stealing and popping the last task compare-and-swap the top.
+ * Top and bottom are on separate cache lines since the owner writes one and
+ * the thieves the other.
+ */
+typedef struct
+{
+    long top __attribute__((aligned(CACHE_LINE_SIZE)));
+    long bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    Task *tasks[DEQUE_SIZE];
+} Deque;
+
+typedef struct
+{
+    Deque deque;
+    TaskPool *pool;
+    pthread_t id;
+} Worker;
+
+/*
+ * The number of tasks which are queued but not taken yet and the number of
+ * threads sleeping because they found no task are accessed sequentially
+ * consistent: a thread going to sleep increments the latter and then checks
+ * the former, a thread queuing a task does it the other way around, so at
+ * least one of them sees the other. The same holds for a thread waiting for
+ * a task and the flag marking the task as done.
+ */
+struct _TaskPool
+{
+    Worker *workers;
+    unsigned numWorkers;
+    long pending;
+    int sleepers;
+    int stopping;
+    Task *spawnedHead;
+    Task *spawnedTail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static __thread Worker *currentWorker;
+static __thread unsigned stealSeed;
+
+int pushTask(Deque *deque, Task *task)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= DEQUE_SIZE)
+        return 0;
+
+    __atomic_store_n(&deque->tasks[bottom & DEQUE_MASK], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+Task* popTask(Deque *deque)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long top;
+    Task *task = NULL;
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top <= bottom)
+    {
+        task = __atomic_load_n(&deque->tasks[bottom & DEQUE_MASK],
+                               __ATOMIC_RELAXED);
+        if (top < bottom)
+            return task;
+
+        /* The last task, which a thief may be taking right now. */
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+    }
+
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+Task* stealTask(Deque *deque)
+{
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long bottom;
+    Task *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return NULL;
+
+    task = __atomic_load_n(&deque->tasks[top & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return task;
+}
+
+/*
+ * Takes a task from the queue of the calling thread, the tasks spawned by
+ * threads outside of the pool or the queue of another worker, in this order.
+ */
+Task* findTask(TaskPool *pool)
+{
+    Worker *self = currentWorker && currentWorker->pool == pool ?
+                   currentWorker : NULL;
+    Task *task = NULL;
+    unsigned i, start;
+
+    if (self)
+        task = popTask(&self->deque);
+
+    if (!task && __atomic_load_n(&pool->spawnedHead, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&pool->mutex);
+
+        if ((task = pool->spawnedHead))
+        {
+            __atomic_store_n(&pool->spawnedHead, task->next, __ATOMIC_RELAXED);
+            if (!task->next)
+                pool->spawnedTail = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    if (!task)
+    {
+        /* A xorshift generator picks the first victim. */
+        if (!stealSeed)
+            stealSeed = (unsigned) (uintptr_t) &stealSeed | 1;
+
+        stealSeed ^= stealSeed << 13;
+        stealSeed ^= stealSeed >> 17;
+        stealSeed ^= stealSeed << 5;
+        start = stealSeed % pool->numWorkers;
+
+        for (i = 0; i < pool->numWorkers && !task; i++)
+        {
+            Worker *victim = &pool->workers[(start + i) % pool->numWorkers];
+
+            if (victim != self)
+                task = stealTask(&victim->deque);
+        }
+    }
+
+    if (task)
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    return task;
+}
+
+void wakeSleepers(TaskPool *pool)
+{
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/*
+ * Puts the calling thread to sleep until a task is queued, the pool is
+ * stopped or, if task isn't NULL, the task is done.
+ */
+void sleepUntilWork(TaskPool *pool, Task *task)
+{
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) &&
+        !pool->stopping &&
+        !(task && __atomic_load_n(&task->done, __ATOMIC_SEQ_CST)))
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void runTask(TaskPool *pool, Task *task)
+{
+    task->exception = exCapture(task->fn, task->arg);
+    __atomic_store_n(&task->done, 1, __ATOMIC_SEQ_CST);
+
+    wakeSleepers(pool);
+}
+
+void* runWorker(void *data)
+{
+    Worker *worker = (Worker *) data;
+    TaskPool *pool = worker->pool;
+    Task *task;
+
+    currentWorker = worker;
+
+    while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+    {
+        if ((task = findTask(pool)))
+            runTask(pool, task);
+        else
+            sleepUntilWork(pool, NULL);
+    }
+
+    return NULL;
+}
+
+TaskPool* taskPoolCreate(unsigned numThreads)
+{
+    TaskPool *pool;
+    unsigned i;
+
+    if (!numThreads)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = online > 0 ? (unsigned) online : 1;
+    }
+
+    pool = calloc(1, sizeof(TaskPool));
+    if (!pool)
+        return NULL;
+
+    if (posix_memalign((void **) &pool->workers, CACHE_LINE_SIZE,
+                       numThreads * sizeof(Worker)))
+    {
+        free(pool);
+        return NULL;
+    }
+
+    memset(pool->workers, 0, numThreads * sizeof(Worker));
+    pool->numWorkers = numThreads;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        pool->workers[i].pool = pool;
+
+        if (pthread_create(&pool->workers[i].id, NULL, runWorker,
+                           &pool->workers[i]))
+        {
+            /* Stop the threads created so far; none of them has a task. */
+            pool->numWorkers = i;
+            taskPoolDestroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void taskPoolDestroy(TaskPool *pool)
+{
+    unsigned i;
+
+    assert(!__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST));
+
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->numWorkers; i++)
+        pthread_join(pool->workers[i].id, NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool);
+}
+
+void taskSpawn(TaskPool *pool, Task *task, void (*fn)(void *), void *arg)
+{
+    Worker *self = currentWorker && currentWorker->pool == pool ?
+                   currentWorker : NULL;
+
+    task->fn = fn;
+    task->arg = arg;
+    task->exception = NULL;
+    task->next = NULL;
+    task->pool = pool;
+    task->done = 0;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    if (self)
+    {
+        if (!pushTask(&self->deque, task))
+        {
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            runTask(pool, task);
+            return;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->mutex);
+
+        if (pool->spawnedTail)
+            pool->spawnedTail->next = task;
+        else
+            __atomic_store_n(&pool->spawnedHead, task, __ATOMIC_RELAXED);
+        pool->spawnedTail = task;
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    wakeSleepers(pool);
+}
+
+void taskWait(Task *task)
+{
+    TaskPool *pool = task->pool;
+    Task *other;
+
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+    {
+        if ((other = findTask(pool)))
+            runTask(pool, other);
+        else
+            sleepUntilWork(pool, task);
+    }
+
+    exRethrowIn(task->exception);
+}
+
+#ifdef TEST
+
+/*
+ * Build with except.c compiled separately, since it has tests of its own:
+ *
+ * gcc -c except.c -o except.o && gcc -DTEST task.c except.o -pthread
+ */
+
+#include <stdio.h>
+
+#define NUM_WORKERS 4
+#define SUM_LIMIT 100000
+#define SUM_GRAIN 100
+#define NUM_SPAWNED (DEQUE_SIZE * 3)
+
+typedef struct
+{
+    long from;
+    long to;
+    long sum;
+    long failAt;
+} Range;
+
+static TaskPool *pool;
+
+/*
+ * Sums up a range of numbers by splitting it in halves, one of which is
+ * spawned as a task. Throws if the range contains failAt.
+ */
+static void sumRange(void *arg)
+{
+    Range *range = (Range *) arg;
+    Range left, right;
+    Task task;
+    Exception *e, *other;
+    long i;
+
+    if (range->to - range->from <= SUM_GRAIN)
+    {
+        range->sum = 0;
+        for (i = range->from; i < range->to; i++)
+        {
+            if (i == range->failAt)
+                exThrow(exOther, NULL, "Failed at %ld.", i);
+            range->sum += i;
+        }
+        return;
+    }
+
+    left = right = *range;
+    left.to = right.from = range->from + (range->to - range->from) / 2;
+
+    taskSpawn(pool, &task, sumRange, &right);
+    e = exCapture(sumRange, &left);
+
+    /* The spawned task uses this stack frame, so wait for it regardless. */
+    try
+        taskWait(&task);
+    catch (other)
+    {
+        if (e)
+            exFree(other);
+        else
+            e = other;
+    }
+
+    exRethrowIn(e);
+
+    range->sum = left.sum + right.sum;
+}
+
+static void countTask(void *arg)
+{
+    __atomic_add_fetch((long *) arg, 1, __ATOMIC_RELAXED);
+}
+
+/* Spawns more tasks than a queue holds from a worker, then waits for all. */
+static void spawnMany(void *arg)
+{
+    static Task tasks[NUM_SPAWNED];
+    int i;
+
+    for (i = 0; i < NUM_SPAWNED; i++)
+        taskSpawn(pool, &tasks[i], countTask, arg);
+
+    for (i = 0; i < NUM_SPAWNED; i++)
+        taskWait(&tasks[i]);
+}
+
+int main(void)
+{
+    Range range = { 0, SUM_LIMIT, 0, -1 };
+    Task task;
+    Exception *e;
+    long count = 0;
+    int caught = 0;
+
+    exInit();
+    pool = taskPoolCreate(NUM_WORKERS);
+    assert(pool);
+
+    taskSpawn(pool, &task, sumRange, &range);
+    taskWait(&task);
+    assert(range.sum == (long) SUM_LIMIT * (SUM_LIMIT - 1) / 2);
+
+    printf("Successfully tested summing up in parallel.\n");
+
+    range.failAt = SUM_LIMIT / 3;
+
+    try
+    {
+        taskSpawn(pool, &task, sumRange, &range);
+        taskWait(&task);
+    }
+    catch (e)
+    {
+        /* Thrown in a leaf task and passed up through every taskWait. */
+        assert(!strcmp(e->msg, "Failed at 33333."));
+        assert(!e->cause);
+        exFree(e);
+        caught = 1;
+    }
+
+    assert(caught);
+
+    printf("Successfully tested throwing from tasks.\n");
+
+    /* Tasks of other callers which the scoped thread runs while waiting
+     * throw exceptions which don't belong to its scope. */
+    caught = 0;
+    exScopeBegin();
+
+    try
+    {
+        taskSpawn(pool, &task, sumRange, &range);
+        taskWait(&task);
+    }
+    catch (e)
+    {
+        assert(!strcmp(e->msg, "Failed at 33333."));
+        exFree(e);
+        caught = 1;
+    }
+
+    assert(exScopeEnd() == 0);
+    assert(caught);
+
+    printf("Successfully tested tasks inside a scope.\n");
+
+    taskSpawn(pool, &task, spawnMany, &count);
+    taskWait(&task);
+    assert(count == NUM_SPAWNED);
+
+    printf("Successfully tested spawning more tasks than a queue holds.\n");
+
+    taskPoolDestroy(pool);
+    exDeinit();
+
+    fflush(stdout);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mihail Ivanchev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A work-stealing task executor whose tasks throw exceptions to the thread
+ * waiting for them.
+ *
+ * The general usage pattern is:
+ *
+ *   TaskPool *pool;
+ *   Task task;
+ *
+ *   exInit();
+ *   pool = taskPoolCreate(0);
+ *
+ *   taskSpawn(pool, &task, fn, arg);
+ *   ... other statements ...
+ *   taskWait(&task);
+ *
+ *   taskPoolDestroy(pool);
+ *   exDeinit();
+ *
+ * Consider the following points:
+ *
+ * - A pool runs its tasks on a fixed number of threads which are created by
+ *   taskPoolCreate, 0 meaning one per online processor. Every thread has its
+ *   own queue of tasks; a thread whose queue is empty steals from the others.
+ *
+ * - The storage of a task is provided by the caller and has to stay valid
+ *   until taskWait returns or throws, so spawning a task doesn't allocate
+ *   memory. A task on the stack of the function spawning it is fine as long
+ *   as the function waits for it, also when it throws, for example by
+ *   calling the code which may throw through exCapture.
+ *
+ * - Every task runs in its own try block. If it throws, the exception is
+ *   kept in the task and taskWait throws it on the waiting thread, see
+ *   exCapture and exRethrowIn. Every task has to be waited for exactly
+ *   once, otherwise its exception is leaked.
+ *
+ * - Tasks may spawn and wait for other tasks. A thread waiting for a task
+ *   runs other tasks in the meantime instead of blocking, so nested waits
+ *   don't starve the pool.
+ *
+ * - If the queue of the spawning thread is full, the task runs right away on
+ *   the spawning thread.
+ *
+ * - exInit has to be called before taskPoolCreate and exDeinit after
+ *   taskPoolDestroy. All tasks have to be waited for before the pool is
+ *   destroyed.
+ */
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include "except.h"
+
+typedef struct _TaskPool TaskPool;
+
+/** The members are not part of the API, do not use them. */
+typedef struct _Task
+{
+    void (*fn)(void *);
+    void *arg;
+    Exception *exception;
+    struct _Task *next;
+    TaskPool *pool;
+    int done;
+} Task;
+
+TaskPool* taskPoolCreate(unsigned numThreads);
+void taskPoolDestroy(TaskPool *pool);
+void taskSpawn(TaskPool *pool, Task *task, void (*fn)(void *), void *arg);
+void taskWait(Task *task);
+
+#endif // __TASK_H__